@@ -6,10 +6,11 @@
 #include "tcp_session_base.hpp"
 #include <typeinfo>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
-#include "multi_index_map.hpp"
 #include "system_exception.hpp"
 #include "log.hpp"
 #include "time.hpp"
@@ -25,77 +26,322 @@ namespace {
 		IO_BUFFER_SIZE          = 4096,
 		MAX_SEND_BUFFER_SIZE    = 65536,
 
-		THROTTLED_RETRY_DELAY   = 5000,
-	};
-
-	struct SessionMapElement {
-		boost::shared_ptr<TcpSessionBase> session;
+		// 每个连接每轮最多读取的次数和字节数。
+		MAX_READS_PER_TURN      = 16,
+		MAX_BYTES_PER_TURN      = 262144,
+		// 读缓冲区大小根据每次实际读到的字节数在这两个值之间调整。
+		MIN_READ_SIZE           = 4096,
+		MAX_READ_SIZE           = 65536,
 
-		TcpSessionBase *addr;
-		// 时间戳，零表示无数据可读/写。
-		boost::uint64_t last_read;
-		boost::uint64_t last_written;
+		THROTTLED_RETRY_DELAY   = 5000,
 
-		explicit SessionMapElement(boost::shared_ptr<TcpSessionBase> session_)
-			: session(STD_MOVE(session_))
-			, addr(session.get()), last_read(0), last_written(0)
-		{
-		}
+		// 超时桶的粒度。超时的连接最多晚这么多毫秒被关闭。
+		TIMEOUT_GRANULARITY     = 256,
+		// 超时之后发送缓冲区不为空的连接稍后再检查。
+		TIMEOUT_RETRY_DELAY     = 1000,
 	};
 
-	MULTI_INDEX_MAP(SessionMap, SessionMapElement,
-		UNIQUE_MEMBER_INDEX(addr)
-		MULTI_MEMBER_INDEX(last_read)
-		MULTI_MEMBER_INDEX(last_written)
-	)
-
 	enum {
-		IDX_ADDR,
-		IDX_READ,
-		IDX_WRITE,
+		PF_WRITEABLE    = 0x0001,
+		PF_UNLINKED     = 0x0002,
+		PF_TIMEOUT      = 0x0004,
+		PF_READABLE     = 0x0008,
 	};
+
+	const boost::uint32_t NULL_INDEX = 0xFFFFFFFFu;
+	// 奇数代数的 ID 不可能是这个值。
+	const boost::uint64_t WAKE_ID = 0;
+
+	// ID 的低 32 位是槽位下标，高 32 位是分配时的代数。
+	inline boost::uint64_t make_id(boost::uint32_t index, boost::uint32_t generation){
+		return (static_cast<boost::uint64_t>(generation) << 32) | index;
+	}
+	inline boost::uint32_t get_index(boost::uint64_t id){
+		return static_cast<boost::uint32_t>(id);
+	}
+	inline boost::uint32_t get_generation(boost::uint64_t id){
+		return static_cast<boost::uint32_t>(id >> 32);
+	}
 }
 
-struct Epoll::SessionMapDelegator : public SessionMap {
+struct Epoll::Slot {
+	// 以下两个成员只能在持有锁的情况下修改。
+	boost::shared_ptr<TcpSessionBase> session;
+	// 奇数表示槽位被占用，偶数表示空闲。每次分配或释放都递增。
+	volatile boost::uint32_t generation;
+
+	// 无锁栈。pending_flags 非零当且仅当这个槽位位于栈中。
+	volatile unsigned pending_flags;
+	volatile boost::uint32_t next_pending;
+	volatile boost::uint32_t unlinked_generation;
+
+	// 以下成员只能在 epoll 线程中访问。
+	bool readable;
+	bool writeable;
+	boost::uint64_t read_retry_time;
+	std::size_t read_size;
+	// 解除节流之后置位，下次读取之前先以空数据调用 on_read_avail()。
+	bool read_resumed;
+	// 超时桶。timeout_id 为零表示不在任何桶中。
+	boost::uint64_t timeout_id;
+	unsigned timeout_bucket;
+	Slot *prev_timeout;
+	Slot *next_timeout;
+
+	Slot()
+		: session(), generation(0)
+		, pending_flags(0), next_pending(NULL_INDEX), unlinked_generation(0)
+		, readable(false), writeable(false), read_retry_time(0), read_size(MIN_READ_SIZE), read_resumed(false)
+		, timeout_id(0), timeout_bucket(0), prev_timeout(NULLPTR), next_timeout(NULLPTR)
+	{
+	}
 };
 
 Epoll::Epoll()
-	: m_mutex()
+	: m_mutex(), m_slot_block_count(0), m_free_slots()
+	, m_pending_head(NULL_INDEX)
+	, m_readable(), m_writeable()
+	, m_timeout_tick(get_fast_mono_clock() / TIMEOUT_GRANULARITY), m_timeout_count(0)
 {
 	if(!m_epoll.reset(::epoll_create(4096))){
 		DEBUG_THROW(SystemException);
 	}
-	m_sessions.reset(new SessionMapDelegator);
+	if(!m_wake_fd.reset(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))){
+		DEBUG_THROW(SystemException);
+	}
+	::epoll_event event;
+	event.events = static_cast< ::uint32_t>(EPOLLIN | EPOLLET);
+	event.data.u64 = WAKE_ID;
+	if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, m_wake_fd.get(), &event) != 0){
+		DEBUG_THROW(SystemException);
+	}
+	for(std::size_t i = 0; i < MAX_SLOT_BLOCKS; ++i){
+		m_slot_blocks[i] = NULLPTR;
+	}
+	for(std::size_t i = 0; i < TIMEOUT_BUCKET_COUNT; ++i){
+		m_timeout_buckets[i] = NULLPTR;
+	}
+	m_readable.reserve(MAX_EPOLL_PUMP_COUNT);
+	m_writeable.reserve(MAX_EPOLL_PUMP_COUNT);
 }
 Epoll::~Epoll(){
+	for(std::size_t i = 0; i < m_slot_block_count; ++i){
+		delete[] m_slot_blocks[i];
+	}
 }
 
-void Epoll::notify_writeable(TcpSessionBase *session) NOEXCEPT {
-	PROFILE_ME;
+Epoll::Slot *Epoll::get_slot(boost::uint32_t index) const NOEXCEPT {
+	const AUTO(block, atomic_load(m_slot_blocks[index / SLOT_BLOCK_SIZE], ATOMIC_CONSUME));
+	return block + index % SLOT_BLOCK_SIZE;
+}
+Epoll::Slot *Epoll::find_slot(boost::uint64_t id) const NOEXCEPT {
+	const AUTO(index, get_index(id));
+	if(index / SLOT_BLOCK_SIZE >= MAX_SLOT_BLOCKS){
+		return NULLPTR;
+	}
+	if(!atomic_load(m_slot_blocks[index / SLOT_BLOCK_SIZE], ATOMIC_CONSUME)){
+		return NULLPTR;
+	}
+	const AUTO(slot, get_slot(index));
+	if(atomic_load(slot->generation, ATOMIC_ACQUIRE) != get_generation(id)){
+		return NULLPTR;
+	}
+	return slot;
+}
 
-	const AUTO(now, get_fast_mono_clock());
-	const RecursiveMutex::UniqueLock lock(m_mutex);
-	const AUTO(it, m_sessions->find<IDX_ADDR>(session));
-	if(it == m_sessions->end<IDX_ADDR>()){
+void Epoll::set_pending(boost::uint64_t id, unsigned flags) NOEXCEPT {
+	const AUTO(slot, find_slot(id));
+	if(!slot){
 		LOG_POSEIDON_DEBUG("Session is no longer in epoll.");
 		return;
 	}
-	m_sessions->set_key<IDX_ADDR, IDX_WRITE>(it, now);
+	// 只有把 pending_flags 从零改为非零的线程负责入栈。
+	unsigned old_flags = atomic_load(slot->pending_flags, ATOMIC_CONSUME);
+	do {
+		if((old_flags & flags) == flags){
+			return;
+		}
+	} while(!atomic_compare_exchange(slot->pending_flags, old_flags, old_flags | flags, ATOMIC_ACQ_REL, ATOMIC_CONSUME));
+	if(old_flags != 0){
+		return;
+	}
+	const AUTO(index, get_index(id));
+	boost::uint32_t head = atomic_load(m_pending_head, ATOMIC_CONSUME);
+	do {
+		atomic_store(slot->next_pending, head, ATOMIC_RELAXED);
+	} while(!atomic_compare_exchange(m_pending_head, head, index, ATOMIC_ACQ_REL, ATOMIC_CONSUME));
+	if(head != NULL_INDEX){
+		// epoll 线程还没有取走之前的元素，已经被唤醒过了。
+		return;
+	}
+	const boost::uint64_t one = 1;
+	if(::write(m_wake_fd.get(), &one, sizeof(one)) < 0){
+		const int err_code = errno;
+		if(err_code != EAGAIN){
+			LOG_POSEIDON_WARNING("Error writing to eventfd: errno = ", err_code);
+		}
+	}
+}
+void Epoll::pump_pending() NOEXCEPT {
+	AUTO(index, atomic_exchange(m_pending_head, NULL_INDEX, ATOMIC_ACQ_REL));
+	while(index != NULL_INDEX){
+		const AUTO(slot, get_slot(index));
+		// 必须在清除 pending_flags 之前读取，之后这个槽位可能被重新入栈。
+		const AUTO(next, atomic_load(slot->next_pending, ATOMIC_CONSUME));
+		const AUTO(flags, atomic_exchange(slot->pending_flags, 0u, ATOMIC_ACQ_REL));
+		const AUTO(generation, atomic_load(slot->generation, ATOMIC_ACQUIRE));
+		if(generation % 2 != 0){
+			const AUTO(id, make_id(index, generation));
+			if((flags & PF_UNLINKED) && (atomic_load(slot->unlinked_generation, ATOMIC_CONSUME) == generation)){
+				free_slot(id, slot, true);
+			} else {
+				if(flags & PF_WRITEABLE){
+					mark_writeable(id, slot);
+				}
+				if(flags & PF_TIMEOUT){
+					refile_timeout(id, slot);
+				}
+				if(flags & PF_READABLE){
+					slot->read_resumed = true;
+					slot->read_retry_time = 0;
+					mark_readable(id, slot);
+				}
+			}
+		}
+		index = next;
+	}
+}
+
+void Epoll::mark_readable(boost::uint64_t id, Slot *slot) NOEXCEPT {
+	if(slot->readable){
+		return;
+	}
+	slot->readable = true;
+	slot->read_retry_time = 0;
+	m_readable.push_back(id);
+}
+void Epoll::mark_writeable(boost::uint64_t id, Slot *slot) NOEXCEPT {
+	if(slot->writeable){
+		return;
+	}
+	slot->writeable = true;
+	m_writeable.push_back(id);
+}
+void Epoll::free_slot(boost::uint64_t id, Slot *slot, bool deleted_from_epoll) NOEXCEPT {
+	boost::shared_ptr<TcpSessionBase> session;
+	{
+		const Mutex::UniqueLock lock(m_mutex);
+		session.swap(slot->session);
+		atomic_add(slot->generation, 1, ATOMIC_RELEASE);
+		// 分配槽位块时已经预留了空间，这里不会抛出异常。
+		m_free_slots.push_back(get_index(id));
+	}
+	if(!deleted_from_epoll){
+		if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_DEL, session->get_fd(), NULLPTR) != 0){
+			const int err_code = errno;
+			LOG_POSEIDON_WARNING("Error deleting from epoll: errno = ", err_code);
+		}
+	}
+	// 就绪队列中残留的 ID 会在下次遍历时因为代数不匹配而被丢弃。
+	slot->readable = false;
+	slot->writeable = false;
+	slot->read_size = MIN_READ_SIZE;
+	slot->read_resumed = false;
+	unfile_timeout(slot);
+}
+
+void Epoll::file_timeout(boost::uint64_t id, Slot *slot, boost::uint64_t shutdown_time) NOEXCEPT {
+	unfile_timeout(slot);
+
+	// 太远的超时放在最后一个桶中，到时候再重新分配。
+	AUTO(tick, shutdown_time / TIMEOUT_GRANULARITY);
+	if(tick < m_timeout_tick){
+		tick = m_timeout_tick;
+	} else if(tick >= m_timeout_tick + TIMEOUT_BUCKET_COUNT){
+		tick = m_timeout_tick + TIMEOUT_BUCKET_COUNT - 1;
+	}
+	const AUTO(bucket, static_cast<unsigned>(tick % TIMEOUT_BUCKET_COUNT));
+
+	slot->timeout_id = id;
+	slot->timeout_bucket = bucket;
+	slot->prev_timeout = NULLPTR;
+	slot->next_timeout = m_timeout_buckets[bucket];
+	if(slot->next_timeout){
+		slot->next_timeout->prev_timeout = slot;
+	}
+	m_timeout_buckets[bucket] = slot;
+	++m_timeout_count;
+}
+void Epoll::unfile_timeout(Slot *slot) NOEXCEPT {
+	if(slot->timeout_id == 0){
+		return;
+	}
+
+	if(slot->prev_timeout){
+		slot->prev_timeout->next_timeout = slot->next_timeout;
+	} else {
+		m_timeout_buckets[slot->timeout_bucket] = slot->next_timeout;
+	}
+	if(slot->next_timeout){
+		slot->next_timeout->prev_timeout = slot->prev_timeout;
+	}
+	slot->timeout_id = 0;
+	slot->prev_timeout = NULLPTR;
+	slot->next_timeout = NULLPTR;
+	--m_timeout_count;
+}
+boost::uint64_t Epoll::get_next_timeout_time() const NOEXCEPT {
+	if(m_timeout_count == 0){
+		return (boost::uint64_t)-1;
+	}
+	for(AUTO(tick, m_timeout_tick); tick < m_timeout_tick + TIMEOUT_BUCKET_COUNT; ++tick){
+		if(m_timeout_buckets[tick % TIMEOUT_BUCKET_COUNT]){
+			// 参考 pump_timeouts()，整个桶都过去之后才会处理。
+			return (tick + 1) * TIMEOUT_GRANULARITY;
+		}
+	}
+	return (boost::uint64_t)-1;
+}
+void Epoll::refile_timeout(boost::uint64_t id, Slot *slot) NOEXCEPT {
+	const AUTO(shutdown_time, atomic_load(slot->session->m_shutdown_time, ATOMIC_CONSUME));
+	if(shutdown_time == 0){
+		unfile_timeout(slot);
+		return;
+	}
+	file_timeout(id, slot, shutdown_time);
+}
+
+void Epoll::notify_writeable(TcpSessionBase *session) NOEXCEPT {
+	PROFILE_ME;
+
+	set_pending(atomic_load(session->m_epoll_id, ATOMIC_CONSUME), PF_WRITEABLE);
 }
 void Epoll::notify_unlinked(TcpSessionBase *session) NOEXCEPT {
 	PROFILE_ME;
 
-	const RecursiveMutex::UniqueLock lock(m_mutex);
-	const AUTO(it, m_sessions->find<IDX_ADDR>(session));
-	if(it == m_sessions->end<IDX_ADDR>()){
+	const AUTO(id, atomic_load(session->m_epoll_id, ATOMIC_CONSUME));
+	const AUTO(slot, find_slot(id));
+	if(!slot){
 		LOG_POSEIDON_WARNING("Session is not in epoll.");
 		return;
 	}
-	if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_DEL, session->get_fd(), (::epoll_event *)-1) != 0){
+	if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_DEL, session->get_fd(), NULLPTR) != 0){
 		const int err_code = errno;
 		LOG_POSEIDON_WARNING("Error deleting from epoll: errno = ", err_code);
 	}
-	m_sessions->erase<IDX_ADDR>(it);
+	// 槽位只能由 epoll 线程释放。
+	atomic_store(slot->unlinked_generation, get_generation(id), ATOMIC_RELEASE);
+	set_pending(id, PF_UNLINKED);
+}
+void Epoll::notify_timeout(TcpSessionBase *session) NOEXCEPT {
+	PROFILE_ME;
+
+	set_pending(atomic_load(session->m_epoll_id, ATOMIC_CONSUME), PF_TIMEOUT);
+}
+void Epoll::notify_readable(TcpSessionBase *session) NOEXCEPT {
+	PROFILE_ME;
+
+	set_pending(atomic_load(session->m_epoll_id, ATOMIC_CONSUME), PF_READABLE);
 }
 
 void Epoll::add_session(const boost::shared_ptr<TcpSessionBase> &session){
@@ -103,63 +349,129 @@ void Epoll::add_session(const boost::shared_ptr<TcpSessionBase> &session){
 
 	boost::weak_ptr<Epoll> weak_this(shared_from_this());
 
-	const RecursiveMutex::UniqueLock lock(m_mutex);
-	const AUTO(result, m_sessions->insert(SessionMapElement(session)));
-	if(!result.second){
-		LOG_POSEIDON_WARNING("Session is already in epoll.");
-		return;
+	const AUTO(old_epoll, session->m_epoll.lock());
+	if(old_epoll.get() == this){
+		if(find_slot(atomic_load(session->m_epoll_id, ATOMIC_CONSUME))){
+			LOG_POSEIDON_WARNING("Session is already in epoll.");
+			return;
+		}
 	}
-	::epoll_event event;
-	event.events = static_cast< ::uint32_t>(EPOLLIN | EPOLLOUT | EPOLLET);
-	event.data.ptr = session.get();
-	if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, session->get_fd(), &event) != 0){
-		const int err_code = errno;
-		m_sessions->erase(result.first); // !!
-		DEBUG_THROW(SystemException, err_code);
+
+	boost::uint64_t id;
+	{
+		const Mutex::UniqueLock lock(m_mutex);
+		if(m_free_slots.empty()){
+			if(m_slot_block_count >= MAX_SLOT_BLOCKS){
+				LOG_POSEIDON_ERROR("Too many sessions in epoll.");
+				DEBUG_THROW(SystemException, EMFILE);
+			}
+			const std::size_t new_size = (m_slot_block_count + 1) * SLOT_BLOCK_SIZE;
+			m_free_slots.reserve(new_size);
+			const AUTO(block, new Slot[SLOT_BLOCK_SIZE]);
+			atomic_store(m_slot_blocks[m_slot_block_count], block, ATOMIC_RELEASE);
+			++m_slot_block_count;
+			// 优先分配下标较小的槽位。
+			for(std::size_t index = new_size; index > new_size - SLOT_BLOCK_SIZE; --index){
+				m_free_slots.push_back(static_cast<boost::uint32_t>(index - 1));
+			}
+		}
+		const AUTO(index, m_free_slots.back());
+		const AUTO(slot, get_slot(index));
+		slot->session = session;
+		id = make_id(index, atomic_add(slot->generation, 1, ATOMIC_RELEASE));
+		m_free_slots.pop_back();
+
+		::epoll_event event;
+		event.events = static_cast< ::uint32_t>(EPOLLIN | EPOLLOUT | EPOLLET);
+		event.data.u64 = id;
+		if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, session->get_fd(), &event) != 0){
+			const int err_code = errno;
+			slot->session.reset();
+			atomic_add(slot->generation, 1, ATOMIC_RELEASE);
+			m_free_slots.push_back(index);
+			DEBUG_THROW(SystemException, err_code);
+		}
+	}
+	session->set_epoll(STD_MOVE(weak_this), id);
+	// 在加入 epoll 之前设置的超时。
+	if(atomic_load(session->m_shutdown_time, ATOMIC_CONSUME) != 0){
+		set_pending(id, PF_TIMEOUT);
 	}
-	session->set_epoll(STD_MOVE(weak_this));
 }
 void Epoll::remove_session(const boost::shared_ptr<TcpSessionBase> &session){
 	PROFILE_ME;
 
-	const RecursiveMutex::UniqueLock lock(m_mutex);
-	const AUTO(it, m_sessions->find<IDX_ADDR>(session.get()));
-	if(it == m_sessions->end<IDX_ADDR>()){
-		LOG_POSEIDON_WARNING("Session is not in epoll.");
-		return;
-	}
-	if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_DEL, session->get_fd(), NULLPTR) != 0){
-		const int err_code = errno;
-		LOG_POSEIDON_WARNING("Error deleting from epoll: errno = ", err_code);
-	}
-	m_sessions->erase<IDX_ADDR>(it);
+	notify_unlinked(session.get());
 }
 void Epoll::snapshot(std::vector<boost::shared_ptr<TcpSessionBase> > &sessions) const {
 	PROFILE_ME;
 
-	const RecursiveMutex::UniqueLock lock(m_mutex);
-	sessions.reserve(m_sessions->size());
-	for(AUTO(it, m_sessions->begin()); it != m_sessions->end(); ++it){
-		sessions.push_back(it->session);
+	const Mutex::UniqueLock lock(m_mutex);
+	sessions.reserve(sessions.size() + m_slot_block_count * SLOT_BLOCK_SIZE - m_free_slots.size());
+	for(std::size_t i = 0; i < m_slot_block_count; ++i){
+		const AUTO(block, m_slot_blocks[i]);
+		for(std::size_t j = 0; j < SLOT_BLOCK_SIZE; ++j){
+			const AUTO_REF(session, block[j].session);
+			if(!session){
+				continue;
+			}
+			sessions.push_back(session);
+		}
 	}
 }
 void Epoll::clear(){
 	PROFILE_ME;
 
-	const RecursiveMutex::UniqueLock lock(m_mutex);
-	AUTO(it, m_sessions->begin());
-	while(it != m_sessions->end()){
-		if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_DEL, it->session->get_fd(), NULLPTR) != 0){
-			const int err_code = errno;
-			LOG_POSEIDON_WARNING("Error deleting from epoll: errno = ", err_code);
+	// 调用这个函数时 epoll 线程不能在运行，因此我们可以接管它的工作。
+	pump_pending();
+	m_readable.clear();
+	m_writeable.clear();
+	for(std::size_t i = 0; i < TIMEOUT_BUCKET_COUNT; ++i){
+		m_timeout_buckets[i] = NULLPTR;
+	}
+	m_timeout_count = 0;
+
+	std::vector<boost::shared_ptr<TcpSessionBase> > sessions;
+	const Mutex::UniqueLock lock(m_mutex);
+	sessions.reserve(m_slot_block_count * SLOT_BLOCK_SIZE - m_free_slots.size());
+	for(std::size_t i = 0; i < m_slot_block_count; ++i){
+		const AUTO(block, m_slot_blocks[i]);
+		for(std::size_t j = 0; j < SLOT_BLOCK_SIZE; ++j){
+			AUTO_REF(slot, block[j]);
+			if(!slot.session){
+				continue;
+			}
+			if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_DEL, slot.session->get_fd(), NULLPTR) != 0){
+				const int err_code = errno;
+				LOG_POSEIDON_WARNING("Error deleting from epoll: errno = ", err_code);
+			}
+			sessions.push_back(STD_MOVE(slot.session));
+			slot.session.reset();
+			atomic_add(slot.generation, 1, ATOMIC_RELEASE);
+			slot.readable = false;
+			slot.writeable = false;
+			slot.read_size = MIN_READ_SIZE;
+			slot.timeout_id = 0;
+			slot.prev_timeout = NULLPTR;
+			slot.next_timeout = NULLPTR;
+			m_free_slots.push_back(static_cast<boost::uint32_t>(i * SLOT_BLOCK_SIZE + j));
 		}
-		it = m_sessions->erase(it);
 	}
 }
 
 std::size_t Epoll::wait(unsigned timeout) NOEXCEPT {
 	PROFILE_ME;
 
+	if(timeout != 0){
+		const AUTO(next_timeout_time, get_next_timeout_time());
+		const AUTO(now, get_fast_mono_clock());
+		if(next_timeout_time <= now){
+			timeout = 0;
+		} else if(next_timeout_time - now < timeout){
+			timeout = static_cast<unsigned>(next_timeout_time - now);
+		}
+	}
+
 	::epoll_event events[MAX_EPOLL_PUMP_COUNT];
 	const int count = ::epoll_wait(m_epoll.get(), events, COUNT_OF(events), (int)timeout);
 	if(count < 0){
@@ -170,21 +482,26 @@ std::size_t Epoll::wait(unsigned timeout) NOEXCEPT {
 		return 0;
 	}
 
-	const AUTO(now, get_fast_mono_clock());
 	for(unsigned i = 0; i < (unsigned)count; ++i){
 		const AUTO_REF(event, events[i]);
 
-		boost::shared_ptr<TcpSessionBase> session;
-		SessionMap::delegated_container::nth_index<IDX_ADDR>::type::iterator it;
-		{
-			const RecursiveMutex::UniqueLock lock(m_mutex);
-			it = m_sessions->find<IDX_ADDR>(static_cast<TcpSessionBase *>(event.data.ptr));
-			if(it == m_sessions->end<IDX_ADDR>()){
-				LOG_POSEIDON_WARNING("Session is not in epoll?");
-				continue;
+		const AUTO(id, static_cast<boost::uint64_t>(event.data.u64));
+		if(id == WAKE_ID){
+			boost::uint64_t value;
+			if(::read(m_wake_fd.get(), &value, sizeof(value)) < 0){
+				const int err_code = errno;
+				if(err_code != EAGAIN){
+					LOG_POSEIDON_WARNING("Error reading from eventfd: errno = ", err_code);
+				}
 			}
-			session = it->session;
+			continue;
+		}
+		const AUTO(slot, find_slot(id));
+		if(!slot){
+			LOG_POSEIDON_DEBUG("Session is no longer in epoll.");
+			continue;
 		}
+		const AUTO(session, slot->session);
 
 		if(event.events & EPOLLERR){
 			int err_code;
@@ -205,7 +522,8 @@ std::size_t Epoll::wait(unsigned timeout) NOEXCEPT {
 			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
 				"Socket error: err_code = ", err_code, ", desc = ", desc, ", typeid = ", typeid(*session).name());
 			session->on_close(err_code);
-			goto _erase_session;
+			free_slot(id, slot, false);
+			continue;
 		}
 		if(event.events & EPOLLHUP){
 			try {
@@ -218,31 +536,22 @@ std::size_t Epoll::wait(unsigned timeout) NOEXCEPT {
 			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
 				"Socket closed gracefully: typeid = ", typeid(*session).name());
 			session->on_close(0);
-			goto _erase_session;
+			free_slot(id, slot, false);
+			continue;
 		}
 
 		if(event.events & EPOLLIN){
-			const RecursiveMutex::UniqueLock lock(m_mutex);
-			m_sessions->set_key<IDX_ADDR, IDX_READ>(it, now);
+			mark_readable(id, slot);
 		}
 		if(event.events & EPOLLOUT){
 			session->set_connected();
 
+			// 发送缓冲区为空时不需要处理。如果其他线程随后写入数据，它会通过 notify_writeable() 通知我们。
 			Mutex::UniqueLock session_lock;
 			if(session->get_send_buffer_size(session_lock) != 0){
-				const RecursiveMutex::UniqueLock lock(m_mutex);
-				m_sessions->set_key<IDX_ADDR, IDX_WRITE>(it, now);
+				mark_writeable(id, slot);
 			}
 		}
-		continue;
-
-	_erase_session:
-		const RecursiveMutex::UniqueLock lock(m_mutex);
-		if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_DEL, session->get_fd(), NULLPTR) != 0){
-			const int err_code = errno;
-			LOG_POSEIDON_WARNING("Error deleting from epoll: errno = ", err_code);
-		}
-		m_sessions->erase<IDX_ADDR>(it);
 	}
 	return (unsigned)count;
 }
@@ -251,65 +560,88 @@ std::size_t Epoll::pump_readable(){
 
 	const AUTO(now, get_fast_mono_clock());
 
-	// 有序的关系型容器在插入元素时迭代器不失效。这一点非常重要。
-	std::vector<VALUE_TYPE(m_sessions->begin<IDX_READ>())> iterators;
-	iterators.reserve(MAX_EPOLL_PUMP_COUNT);
-	{
-		const RecursiveMutex::UniqueLock lock(m_mutex);
-		const AUTO(range, std::make_pair(m_sessions->upper_bound<IDX_READ>(0), m_sessions->upper_bound<IDX_READ>(now)));
-		iterators.reserve(static_cast<std::size_t>(std::distance(range.first, range.second)));
-		for(AUTO(it, range.first); it != range.second; ++it){
-			iterators.push_back(it);
+	std::size_t count = 0;
+	// 遍历的同时原地压缩就绪队列。回调函数中不会修改这个队列。
+	AUTO(write_it, m_readable.begin());
+	for(AUTO(it, m_readable.begin()); it != m_readable.end(); ++it){
+		const AUTO(id, *it);
+		const AUTO(slot, find_slot(id));
+		if(!slot){
+			continue;
 		}
-	}
-	for(AUTO(iit, iterators.begin()); iit != iterators.end(); ++iit){
-		const AUTO(it, *iit);
-		const AUTO(session, it->session);
+		if(now < slot->read_retry_time){
+			*(write_it++) = id;
+			continue;
+		}
+		const AUTO(session, slot->session);
+		++count;
 
+		bool still_readable = false;
 		try {
-			if(session->is_throttled()){
-				LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
-					"Session is throttled: typeid = ", typeid(*session).name());
+			std::size_t bytes_this_turn = 0;
+			for(unsigned reads = 0; reads < MAX_READS_PER_TURN; ++reads){
+				if(bytes_this_turn >= MAX_BYTES_PER_TURN){
+					// 预算用尽，让其他连接也有机会被处理。
+					still_readable = true;
+					goto _next;
+				}
 
-				const RecursiveMutex::UniqueLock lock(m_mutex);
-				m_sessions->set_key<IDX_READ, IDX_READ>(it, now + THROTTLED_RETRY_DELAY);
-				continue;
-			}
+				if(session->is_throttled() || session->is_read_paused()){
+					LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
+						"Session is throttled: typeid = ", typeid(*session).name());
 
-			std::size_t send_buffer_size;
-			{
-				Mutex::UniqueLock lock;
-				send_buffer_size = session->get_send_buffer_size(lock);
-			}
-			if(send_buffer_size > MAX_SEND_BUFFER_SIZE){
-				LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
-					"Max send buffer size exceeded: typeid = ", typeid(*session).name());
+					slot->read_retry_time = now + THROTTLED_RETRY_DELAY;
+					still_readable = true;
+					goto _next;
+				}
 
-				const RecursiveMutex::UniqueLock lock(m_mutex);
-				m_sessions->set_key<IDX_READ, IDX_READ>(it, now + THROTTLED_RETRY_DELAY);
-				continue;
-			}
+				std::size_t send_buffer_size;
+				{
+					Mutex::UniqueLock lock;
+					send_buffer_size = session->get_send_buffer_size(lock);
+				}
+				if(send_buffer_size > MAX_SEND_BUFFER_SIZE){
+					LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
+						"Max send buffer size exceeded: typeid = ", typeid(*session).name());
 
-			unsigned char temp[IO_BUFFER_SIZE];
-			const AUTO(result, session->sync_read_and_process(temp, sizeof(temp)));
-			if(result.bytes_transferred < 0){
-				if(result.err_code == EINTR){
-					continue;
+					slot->read_retry_time = now + THROTTLED_RETRY_DELAY;
+					still_readable = true;
+					goto _next;
 				}
-				if(result.err_code == EAGAIN){
-					const RecursiveMutex::UniqueLock lock(m_mutex);
-					m_sessions->set_key<IDX_READ, IDX_READ>(it, 0);
+
+				if(slot->read_resumed){
+					// 节流期间暂停处理的数据可能还在会话的缓冲区中，即使套接字上没有新数据也要处理。
+					slot->read_resumed = false;
+					session->on_read_avail(StreamBuffer());
 					continue;
 				}
-				DEBUG_THROW(SystemException, result.err_code);
-			} else if(result.bytes_transferred == 0){
-				session->shutdown_read();
-				session->on_read_hup();
 
-				const RecursiveMutex::UniqueLock lock(m_mutex);
-				m_sessions->set_key<IDX_READ, IDX_READ>(it, 0);
-				continue;
+				const AUTO(read_size, slot->read_size);
+				const AUTO(result, session->sync_read_and_process(read_size));
+				if(result.bytes_transferred < 0){
+					if(result.err_code == EINTR){
+						continue;
+					}
+					if(result.err_code == EAGAIN){
+						goto _next;
+					}
+					DEBUG_THROW(SystemException, result.err_code);
+				} else if(result.bytes_transferred == 0){
+					session->shutdown_read();
+					session->on_read_hup();
+					goto _next;
+				}
+
+				const AUTO(bytes_read, static_cast<std::size_t>(result.bytes_transferred));
+				bytes_this_turn += bytes_read;
+				// 读满则加倍，不足四分之一则减半。
+				if((bytes_read >= read_size) && (read_size < MAX_READ_SIZE)){
+					slot->read_size = read_size * 2;
+				} else if((bytes_read < read_size / 4) && (read_size > MIN_READ_SIZE)){
+					slot->read_size = read_size / 2;
+				}
 			}
+			still_readable = true;
 		} catch(std::exception &e){
 			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
 				"std::exception thrown while reading socket: what = ", e.what(), ", typeid = ", typeid(*session).name());
@@ -319,50 +651,52 @@ std::size_t Epoll::pump_readable(){
 				"Unknown exception thrown while reading socket: typeid = ", typeid(*session).name());
 			session->force_shutdown();
 		}
+	_next:
+		if(still_readable){
+			*(write_it++) = id;
+		} else {
+			slot->readable = false;
+		}
 	}
-	return iterators.size();
+	m_readable.erase(write_it, m_readable.end());
+	return count;
 }
 std::size_t Epoll::pump_writeable(){
 	PROFILE_ME;
 
-	const AUTO(now, get_fast_mono_clock());
+	pump_pending();
 
-	// 有序的关系型容器在插入元素时迭代器不失效。这一点非常重要。
-	std::vector<VALUE_TYPE(m_sessions->begin<IDX_WRITE>())> iterators;
-	iterators.reserve(MAX_EPOLL_PUMP_COUNT);
-	{
-		const RecursiveMutex::UniqueLock lock(m_mutex);
-		const AUTO(range, std::make_pair(m_sessions->upper_bound<IDX_WRITE>(0), m_sessions->upper_bound<IDX_WRITE>(now)));
-		iterators.reserve(static_cast<std::size_t>(std::distance(range.first, range.second)));
-		for(AUTO(it, range.first); it != range.second; ++it){
-			iterators.push_back(it);
+	std::size_t count = 0;
+	// 遍历的同时原地压缩就绪队列。回调函数中不会修改这个队列。
+	AUTO(write_it, m_writeable.begin());
+	for(AUTO(it, m_writeable.begin()); it != m_writeable.end(); ++it){
+		const AUTO(id, *it);
+		const AUTO(slot, find_slot(id));
+		if(!slot){
+			continue;
 		}
-	}
-	for(AUTO(iit, iterators.begin()); iit != iterators.end(); ++iit){
-		const AUTO(it, *iit);
-		const AUTO(session, it->session);
+		const AUTO(session, slot->session);
+		++count;
 
+		bool still_writeable = false;
 		try {
 			unsigned char temp[IO_BUFFER_SIZE];
 			const AUTO(result, session->sync_write(temp, sizeof(temp)));
 			if(result.bytes_transferred < 0){
 				if(result.err_code == EINTR){
-					continue;
+					still_writeable = true;
+					goto _next;
 				}
 				if(result.err_code == EAGAIN){
-					const RecursiveMutex::UniqueLock lock(m_mutex);
-					m_sessions->set_key<IDX_WRITE, IDX_WRITE>(it, 0);
-					continue;
+					goto _next;
 				}
 				DEBUG_THROW(SystemException, result.err_code);
 			} else if(result.bytes_transferred == 0){
 				Mutex::UniqueLock session_lock;
-				if(session->get_send_buffer_size(session_lock) == 0){
-					const RecursiveMutex::UniqueLock lock(m_mutex);
-					m_sessions->set_key<IDX_WRITE, IDX_WRITE>(it, 0);
-				}
-				continue;
+				still_writeable = session->get_send_buffer_size(session_lock) != 0;
+				goto _next;
 			}
+			still_writeable = true;
 		} catch(std::exception &e){
 			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
 				"std::exception thrown while writing socket: what = ", e.what(), ", typeid = ", typeid(*session).name());
@@ -372,8 +706,60 @@ std::size_t Epoll::pump_writeable(){
 				"Unknown exception thrown while writing socket: typeid = ", typeid(*session).name());
 			session->force_shutdown();
 		}
+	_next:
+		if(still_writeable){
+			*(write_it++) = id;
+		} else {
+			slot->writeable = false;
+		}
+	}
+	m_writeable.erase(write_it, m_writeable.end());
+	return count;
+}
+
+std::size_t Epoll::pump_timeouts(){
+	PROFILE_ME;
+
+	pump_pending();
+
+	const AUTO(now, get_fast_mono_clock());
+	const AUTO(now_tick, now / TIMEOUT_GRANULARITY);
+
+	std::size_t count = 0;
+	// 只有整个桶都已经过去时才处理它。
+	while(m_timeout_tick < now_tick){
+		if(m_timeout_count == 0){
+			m_timeout_tick = now_tick;
+			break;
+		}
+		const AUTO(bucket, static_cast<unsigned>(m_timeout_tick % TIMEOUT_BUCKET_COUNT));
+		AUTO(slot, m_timeout_buckets[bucket]);
+		m_timeout_buckets[bucket] = NULLPTR;
+		while(slot){
+			const AUTO(next, slot->next_timeout);
+			const AUTO(id, slot->timeout_id);
+			slot->timeout_id = 0;
+			slot->prev_timeout = NULLPTR;
+			slot->next_timeout = NULLPTR;
+			--m_timeout_count;
+
+			// 推迟过的超时在这里重新分配。
+			const AUTO_REF(session, slot->session);
+			const AUTO(shutdown_time, atomic_load(session->m_shutdown_time, ATOMIC_CONSUME));
+			if(shutdown_time == 0){
+				// 超时已被取消。
+			} else if(now < shutdown_time){
+				file_timeout(id, slot, shutdown_time);
+			} else if(session->shutdown_timed_out()){
+				++count;
+			} else {
+				file_timeout(id, slot, now + TIMEOUT_RETRY_DELAY);
+			}
+			slot = next;
+		}
+		++m_timeout_tick;
 	}
-	return iterators.size();
+	return count;
 }
 
 }
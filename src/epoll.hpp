@@ -5,13 +5,13 @@
 #define POSEIDON_EPOLL_HPP_
 
 #include "cxx_util.hpp"
-#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/cstdint.hpp>
 #include <vector>
 #include <cstddef>
 #include "raii.hpp"
-#include "recursive_mutex.hpp"
+#include "mutex.hpp"
 
 namespace Poseidon {
 
@@ -21,20 +21,65 @@ class Epoll : NONCOPYABLE, public boost::enable_shared_from_this<Epoll> {
 	friend TcpSessionBase;
 
 private:
-	class SessionMapDelegator;
+	struct Slot;
+
+	enum {
+		SLOT_BLOCK_SIZE     = 1024,
+		MAX_SLOT_BLOCKS     = 1024,
+
+		TIMEOUT_BUCKET_COUNT    = 256,
+	};
 
 private:
-	mutable RecursiveMutex m_mutex;
 	UniqueFile m_epoll;
-	boost::scoped_ptr<SessionMapDelegator> m_sessions;
+	// 其他线程向空的无锁栈中压入元素时通过它唤醒 epoll 线程。
+	UniqueFile m_wake_fd;
+
+	// 槽位只能在持有锁的情况下分配或释放，并且只有 epoll 线程会释放槽位。
+	// 因此 epoll 线程读取被占用的槽位不需要锁。槽位的内存在析构之前不会被释放。
+	mutable Mutex m_mutex;
+	Slot *volatile m_slot_blocks[MAX_SLOT_BLOCKS];
+	std::size_t m_slot_block_count;
+	std::vector<boost::uint32_t> m_free_slots;
+
+	// 无锁栈，其他线程通过它通知 epoll 线程。
+	volatile boost::uint32_t m_pending_head;
+
+	// 就绪队列，保存槽位 ID。只能在 epoll 线程中访问。
+	std::vector<boost::uint64_t> m_readable;
+	std::vector<boost::uint64_t> m_writeable;
+
+	// 按照超时时间分桶的侵入式链表，用于批量关闭超时的连接。只能在 epoll 线程中访问。
+	Slot *m_timeout_buckets[TIMEOUT_BUCKET_COUNT];
+	boost::uint64_t m_timeout_tick;
+	std::size_t m_timeout_count;
 
 public:
 	Epoll();
 	~Epoll();
 
 private:
+	Slot *get_slot(boost::uint32_t index) const NOEXCEPT;
+	// 如果 ID 已经失效，返回空指针。
+	Slot *find_slot(boost::uint64_t id) const NOEXCEPT;
+
+	void set_pending(boost::uint64_t id, unsigned flags) NOEXCEPT;
+	void pump_pending() NOEXCEPT;
+
+	void mark_readable(boost::uint64_t id, Slot *slot) NOEXCEPT;
+	void mark_writeable(boost::uint64_t id, Slot *slot) NOEXCEPT;
+	void free_slot(boost::uint64_t id, Slot *slot, bool deleted_from_epoll) NOEXCEPT;
+
+	void file_timeout(boost::uint64_t id, Slot *slot, boost::uint64_t shutdown_time) NOEXCEPT;
+	void unfile_timeout(Slot *slot) NOEXCEPT;
+	void refile_timeout(boost::uint64_t id, Slot *slot) NOEXCEPT;
+	// 返回下一个超时桶到期的时刻，没有超时的连接则返回 -1。
+	boost::uint64_t get_next_timeout_time() const NOEXCEPT;
+
 	void notify_writeable(TcpSessionBase *session) NOEXCEPT;
 	void notify_unlinked(TcpSessionBase *session) NOEXCEPT;
+	void notify_timeout(TcpSessionBase *session) NOEXCEPT;
+	void notify_readable(TcpSessionBase *session) NOEXCEPT;
 
 public:
 	void add_session(const boost::shared_ptr<TcpSessionBase> &session);
@@ -42,10 +87,12 @@ public:
 	void snapshot(std::vector<boost::shared_ptr<TcpSessionBase> > &sessions) const;
 	void clear();
 
-	// 这三个函数必须位于同一个线程内调用。
+	// 这四个函数必须位于同一个线程内调用。
+	// 如果有超时的连接需要处理，实际等待的时间会缩短。
 	std::size_t wait(unsigned timeout) NOEXCEPT;
 	std::size_t pump_readable();
 	std::size_t pump_writeable();
+	std::size_t pump_timeouts();
 };
 
 }
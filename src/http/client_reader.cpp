@@ -4,6 +4,7 @@
 #include "../precompiled.hpp"
 #include "client_reader.hpp"
 #include "const_strings.hpp"
+#include "header_names.hpp"
 #include "exception.hpp"
 #include "utilities.hpp"
 #include <string.h>
@@ -131,7 +132,7 @@ namespace Http {
 						LOG_POSEIDON_WARNING("Invalid HTTP header: line = ", line);
 						DEBUG_THROW(BasicException, sslit("Malformed HTTP header in response headers"));
 					}
-					m_response_headers.headers.append(SharedNts(line.data(), pos), ltrim(line.substr(pos + 1)));
+					m_response_headers.headers.append(intern_header_name(line.data(), pos), ltrim(line.substr(pos + 1)));
 
 					m_size_expecting = EXPECTING_NEW_LINE;
 					// m_state = S_HEADERS;
@@ -255,7 +256,7 @@ namespace Http {
 						LOG_POSEIDON_WARNING("Invalid chunk trailer: line = ", line);
 						DEBUG_THROW(BasicException, sslit("Invalid HTTP header in chunk trailer"));
 					}
-					m_chunked_trailer.append(SharedNts(line.data(), pos), ltrim(line.substr(pos + 1)));
+					m_chunked_trailer.append(intern_header_name(line.data(), pos), ltrim(line.substr(pos + 1)));
 
 					m_size_expecting = EXPECTING_NEW_LINE;
 					// m_state = S_CHUNKED_TRAILER;
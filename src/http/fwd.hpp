@@ -10,6 +10,7 @@ namespace Http {
 	class RequestHeaders;
 	class ResponseHeaders;
 	class Exception;
+	class HeaderTemplate;
 
 	class ServerReader;
 	class ServerWriter;
@@ -0,0 +1,104 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2016, LH_Mouse. All wrongs reserved.
+
+#include "../precompiled.hpp"
+#include "header_names.hpp"
+#include <algorithm>
+#include <strings.h>
+
+namespace Poseidon {
+
+namespace Http {
+	namespace {
+		struct HeaderName {
+			std::size_t len;
+			const char *str;
+		};
+
+#define DEFINE_HEADER_NAME(str_)	{ sizeof(str_) - 1, str_ }
+
+		// 按长度排序。
+		const HeaderName HEADER_NAME_TABLE[] = {
+			DEFINE_HEADER_NAME("TE"),
+			DEFINE_HEADER_NAME("Age"),
+			DEFINE_HEADER_NAME("DNT"),
+			DEFINE_HEADER_NAME("Via"),
+			DEFINE_HEADER_NAME("Date"),
+			DEFINE_HEADER_NAME("ETag"),
+			DEFINE_HEADER_NAME("From"),
+			DEFINE_HEADER_NAME("Host"),
+			DEFINE_HEADER_NAME("Vary"),
+			DEFINE_HEADER_NAME("Allow"),
+			DEFINE_HEADER_NAME("Range"),
+			DEFINE_HEADER_NAME("Accept"),
+			DEFINE_HEADER_NAME("Cookie"),
+			DEFINE_HEADER_NAME("Expect"),
+			DEFINE_HEADER_NAME("Origin"),
+			DEFINE_HEADER_NAME("Pragma"),
+			DEFINE_HEADER_NAME("Server"),
+			DEFINE_HEADER_NAME("Expires"),
+			DEFINE_HEADER_NAME("Referer"),
+			DEFINE_HEADER_NAME("Trailer"),
+			DEFINE_HEADER_NAME("Upgrade"),
+			DEFINE_HEADER_NAME("Warning"),
+			DEFINE_HEADER_NAME("If-Match"),
+			DEFINE_HEADER_NAME("If-Range"),
+			DEFINE_HEADER_NAME("Location"),
+			DEFINE_HEADER_NAME("X-Real-IP"),
+			DEFINE_HEADER_NAME("Connection"),
+			DEFINE_HEADER_NAME("Keep-Alive"),
+			DEFINE_HEADER_NAME("Set-Cookie"),
+			DEFINE_HEADER_NAME("User-Agent"),
+			DEFINE_HEADER_NAME("Retry-After"),
+			DEFINE_HEADER_NAME("Content-Type"),
+			DEFINE_HEADER_NAME("Accept-Ranges"),
+			DEFINE_HEADER_NAME("Authorization"),
+			DEFINE_HEADER_NAME("Cache-Control"),
+			DEFINE_HEADER_NAME("Content-Range"),
+			DEFINE_HEADER_NAME("If-None-Match"),
+			DEFINE_HEADER_NAME("Last-Modified"),
+			DEFINE_HEADER_NAME("Accept-Charset"),
+			DEFINE_HEADER_NAME("Content-Length"),
+			DEFINE_HEADER_NAME("Accept-Encoding"),
+			DEFINE_HEADER_NAME("Accept-Language"),
+			DEFINE_HEADER_NAME("X-Forwarded-For"),
+			DEFINE_HEADER_NAME("Content-Encoding"),
+			DEFINE_HEADER_NAME("Content-Language"),
+			DEFINE_HEADER_NAME("Content-Location"),
+			DEFINE_HEADER_NAME("WWW-Authenticate"),
+			DEFINE_HEADER_NAME("X-Requested-With"),
+			DEFINE_HEADER_NAME("Sec-WebSocket-Key"),
+			DEFINE_HEADER_NAME("Transfer-Encoding"),
+			DEFINE_HEADER_NAME("X-Forwarded-Proto"),
+			DEFINE_HEADER_NAME("If-Modified-Since"),
+			DEFINE_HEADER_NAME("Content-Disposition"),
+			DEFINE_HEADER_NAME("If-Unmodified-Since"),
+			DEFINE_HEADER_NAME("Proxy-Authorization"),
+			DEFINE_HEADER_NAME("Sec-WebSocket-Accept"),
+			DEFINE_HEADER_NAME("Sec-WebSocket-Version"),
+			DEFINE_HEADER_NAME("Sec-WebSocket-Protocol"),
+			DEFINE_HEADER_NAME("Sec-WebSocket-Extensions"),
+			DEFINE_HEADER_NAME("Upgrade-Insecure-Requests"),
+		};
+
+#undef DEFINE_HEADER_NAME
+
+		bool header_name_length_less(const HeaderName &lhs, std::size_t rhs){
+			return lhs.len < rhs;
+		}
+	}
+
+	SharedNts intern_header_name(const char *str, std::size_t len){
+		const HeaderName *it = std::lower_bound(HEADER_NAME_TABLE, HEADER_NAME_TABLE + COUNT_OF(HEADER_NAME_TABLE),
+			len, &header_name_length_less);
+		while((it != HEADER_NAME_TABLE + COUNT_OF(HEADER_NAME_TABLE)) && (it->len == len)){
+			if(::strncasecmp(it->str, str, len) == 0){
+				return SharedNts::view(it->str);
+			}
+			++it;
+		}
+		return SharedNts(str, len);
+	}
+}
+
+}
@@ -0,0 +1,20 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2016, LH_Mouse. All wrongs reserved.
+
+#ifndef POSEIDON_HTTP_HEADER_NAMES_HPP_
+#define POSEIDON_HTTP_HEADER_NAMES_HPP_
+
+#include <cstddef>
+#include "../shared_nts.hpp"
+
+namespace Poseidon {
+
+namespace Http {
+	// 解析报文时使用。常见的头名称（不区分大小写）返回指向静态字符串的 SharedNts，
+	// 其大小写与本框架中查找时使用的写法一致，并且不分配内存；其他名称原样复制一份。
+	extern SharedNts intern_header_name(const char *str, std::size_t len);
+}
+
+}
+
+#endif
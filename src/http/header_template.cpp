@@ -0,0 +1,39 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2016, LH_Mouse. All wrongs reserved.
+
+#include "../precompiled.hpp"
+#include "header_template.hpp"
+#include "../log.hpp"
+#include "../exception.hpp"
+
+namespace Poseidon {
+
+namespace Http {
+	HeaderTemplate::HeaderTemplate(OptionalMap headers)
+		: m_headers(STD_MOVE(headers))
+	{
+		if(m_headers.has("Content-Length") || m_headers.has("Transfer-Encoding")){
+			LOG_POSEIDON_ERROR("Content-Length and Transfer-Encoding are not allowed in a header template");
+			DEBUG_THROW(BasicException, sslit("Content-Length and Transfer-Encoding are not allowed in a header template"));
+		}
+
+		std::string str, str_without_entity;
+		for(AUTO(it, m_headers.begin()); it != m_headers.end(); ++it){
+			std::string line;
+			line += it->first.get();
+			line += ": ";
+			line += it->second;
+			line += "\r\n";
+			str += line;
+			if(std::strcmp(it->first.get(), "Content-Type") != 0){
+				str_without_entity += line;
+			}
+		}
+		str += "\r\n";
+		str_without_entity += "\r\n";
+		m_encoded.put(str);
+		m_encoded_without_entity.put(str_without_entity);
+	}
+}
+
+}
@@ -0,0 +1,45 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2016, LH_Mouse. All wrongs reserved.
+
+#ifndef POSEIDON_HTTP_HEADER_TEMPLATE_HPP_
+#define POSEIDON_HTTP_HEADER_TEMPLATE_HPP_
+
+#include "../cxx_ver.hpp"
+#include "../stream_buffer.hpp"
+#include "../optional_map.hpp"
+
+namespace Poseidon {
+
+namespace Http {
+	// 预先编码的一组响应报头，可以在多个响应中重复使用，例如固定的 Content-Type、Server 和 Cache-Control。
+	// 通常在 servlet 初始化时创建一次。发送时只复制 StreamBuffer 的块，数据是共享的。
+	// 创建之后不可修改，可以在多个线程中同时使用。
+	// 不能包含 Content-Length 和 Transfer-Encoding，它们由 ServerWriter 根据正文生成。
+	// 响应中的报头不能和模板中的重复，否则 ServerWriter 会抛出异常。
+	class HeaderTemplate {
+	private:
+		OptionalMap m_headers;
+		// 以空行结尾。
+		StreamBuffer m_encoded;
+		// 同上，但是不含 Content-Type，用于没有正文的响应。
+		StreamBuffer m_encoded_without_entity;
+
+	public:
+		explicit HeaderTemplate(OptionalMap headers);
+
+	public:
+		const OptionalMap &get_headers() const {
+			return m_headers;
+		}
+		const StreamBuffer &get_encoded() const {
+			return m_encoded;
+		}
+		const StreamBuffer &get_encoded_without_entity() const {
+			return m_encoded_without_entity;
+		}
+	};
+}
+
+}
+
+#endif
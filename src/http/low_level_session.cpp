@@ -86,7 +86,8 @@ namespace Http {
 			m_upgraded_session = STD_MOVE(upgraded_session);
 			return false;
 		}
-		return true;
+		// 暂停读取时也暂停解析，剩下的数据留在队列中，恢复读取之后由 on_read_avail() 继续处理。
+		return !is_read_paused();
 	}
 
 	long LowLevelSession::on_encoded_data_avail(StreamBuffer encoded){
@@ -124,6 +125,20 @@ namespace Http {
 		response_headers.headers = STD_MOVE(headers);
 		return send(STD_MOVE(response_headers), STD_MOVE(entity));
 	}
+	bool LowLevelSession::send(ResponseHeaders response_headers, const HeaderTemplate &header_template, StreamBuffer entity){
+		PROFILE_ME;
+
+		return ServerWriter::put_response(STD_MOVE(response_headers), header_template, STD_MOVE(entity));
+	}
+	bool LowLevelSession::send(StatusCode status_code, const HeaderTemplate &header_template, StreamBuffer entity){
+		PROFILE_ME;
+
+		ResponseHeaders response_headers;
+		response_headers.version = 10001;
+		response_headers.status_code = status_code;
+		response_headers.reason = get_status_code_desc(status_code).desc_short;
+		return send(STD_MOVE(response_headers), header_template, STD_MOVE(entity));
+	}
 	bool LowLevelSession::send_default(StatusCode status_code, OptionalMap headers){
 		PROFILE_ME;
 
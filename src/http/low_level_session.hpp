@@ -33,6 +33,14 @@ namespace Http {
 			// Epoll 线程读取不需要锁。
 			return m_upgraded_session;
 		}
+		// 已经收到但尚未解析的数据。
+		std::size_t get_low_level_queue_size() const {
+			return ServerReader::get_queue().size();
+		}
+		// 已经解析的报头和 trailer 的总字节数，只增不减。
+		boost::uint64_t get_low_level_header_size_total() const {
+			return ServerReader::get_header_size_total();
+		}
 
 		// TcpSessionBase
 		void on_read_hup() NOEXCEPT OVERRIDE;
@@ -61,6 +69,8 @@ namespace Http {
 		bool send(ResponseHeaders response_headers, StreamBuffer entity = StreamBuffer());
 		bool send(StatusCode status_code, StreamBuffer entity = StreamBuffer(), std::string content_type = "text/plain");
 		bool send(StatusCode status_code, OptionalMap headers, StreamBuffer entity = StreamBuffer());
+		bool send(ResponseHeaders response_headers, const HeaderTemplate &header_template, StreamBuffer entity = StreamBuffer());
+		bool send(StatusCode status_code, const HeaderTemplate &header_template, StreamBuffer entity = StreamBuffer());
 		bool send_default(StatusCode status_code, OptionalMap headers = OptionalMap());
 	};
 }
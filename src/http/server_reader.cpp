@@ -4,9 +4,11 @@
 #include "../precompiled.hpp"
 #include "server_reader.hpp"
 #include "const_strings.hpp"
+#include "header_names.hpp"
 #include "exception.hpp"
 #include "utilities.hpp"
 #include <string.h>
+#include <climits>
 #include <sys/types.h>
 #include <unistd.h>
 #include "../log.hpp"
@@ -16,8 +18,60 @@
 namespace Poseidon {
 
 namespace Http {
+	namespace {
+		const char *skip_spaces(const char *begin, const char *end){
+			AUTO(read, begin);
+			while((read != end) && ((*read == ' ') || (*read == '\t'))){
+				++read;
+			}
+			return read;
+		}
+
+		// 解析 "HTTP/主版本号.次版本号"，必须占满整个区间。
+		bool parse_http_version(unsigned &version, const char *begin, const char *end){
+			if((end - begin < 5) || (std::memcmp(begin, "HTTP/", 5) != 0)){
+				return false;
+			}
+			AUTO(read, begin + 5);
+			boost::uint64_t parts[2];
+			for(unsigned i = 0; i < 2; ++i){
+				if((i != 0) && ((read == end) || (*(read++) != '.'))){
+					return false;
+				}
+				const AUTO(digits_begin, read);
+				parts[i] = 0;
+				while((read != end) && (static_cast<unsigned>(*read - '0') < 10)){
+					if(read - digits_begin >= 15){
+						return false;
+					}
+					parts[i] = parts[i] * 10 + static_cast<unsigned>(*read - '0');
+					++read;
+				}
+				if(read == digits_begin){
+					return false;
+				}
+			}
+			if(read != end){
+				return false;
+			}
+			const AUTO(value, parts[0] * 10000 + parts[1]);
+			version = (value > UINT_MAX) ? UINT_MAX : static_cast<unsigned>(value);
+			return true;
+		}
+
+		int get_hex_digit(char ch){
+			if(static_cast<unsigned>(ch - '0') < 10){
+				return ch - '0';
+			}
+			if(static_cast<unsigned>((ch | 0x20) - 'a') < 6){
+				return (ch | 0x20) - 'a' + 10;
+			}
+			return -1;
+		}
+	}
+
 	ServerReader::ServerReader()
-		: m_size_expecting(EXPECTING_NEW_LINE), m_state(S_FIRST_HEADER)
+		: m_size_expecting(EXPECTING_NEW_LINE), m_state(S_FIRST_HEADER), m_header_size_total(0)
 	{
 	}
 	ServerReader::~ServerReader(){
@@ -35,92 +89,105 @@ namespace Http {
 		do {
 			const bool expecting_new_line = (m_size_expecting == EXPECTING_NEW_LINE);
 
+			// 按行解析的状态使用 [line, line_end)，不含换行符。其他状态使用 expected。
+			const char *line = NULLPTR;
+			const char *line_end = NULLPTR;
+			std::size_t line_total = 0;
+			StreamBuffer expected;
+
 			if(expecting_new_line){
+				// memchr() 是向量化的，比逐字节比较快得多。
 				std::size_t lf_offset = 0;
-				AUTO(ce, m_queue.get_const_chunk_enumerator());
-				while(ce){
-					const AUTO(pos, std::find(ce.begin(), ce.end(), '\n'));
-					if(pos != ce.end()){
-						lf_offset += static_cast<std::size_t>(pos - ce.begin());
-						goto _found;
+				const void *lf = NULLPTR;
+				for(AUTO(ce, m_queue.get_const_chunk_enumerator()); ce; ++ce){
+					lf = std::memchr(ce.data(), '\n', ce.size());
+					if(lf){
+						lf_offset += static_cast<std::size_t>(static_cast<const unsigned char *>(lf) - ce.data());
+						break;
 					}
 					lf_offset += ce.size();
-					++ce;
 				}
-				// 没找到换行符。
-				break;
-			_found:
-				m_size_expecting = lf_offset + 1;
-			} else {
-				if(m_queue.size() < m_size_expecting){
+				if(!lf){
+					// 没找到换行符。
 					break;
 				}
-			}
+				line_total = lf_offset + 1;
+				// 报头行在解析之后就从队列中移除了，这里单独计数，以便调用者限制请求的长度。
+				// chunk 头不保存，不计入。
+				if(m_state != S_CHUNK_HEADER){
+					m_header_size_total += line_total;
+				}
 
-			AUTO(expected, m_queue.cut_off(m_size_expecting));
-			if(expecting_new_line){
-				expected.unput(); // '\n'
-				if(expected.back() == '\r'){
-					expected.unput();
+				// 通常整行都在第一个块中，直接在块中解析，不复制。
+				const AUTO(first, m_queue.get_const_chunk_enumerator());
+				if(first.size() >= line_total){
+					line = reinterpret_cast<const char *>(first.data());
+				} else {
+					m_line.resize(line_total);
+					m_queue.peek(&m_line[0], line_total);
+					line = m_line.data();
 				}
+				line_end = line + lf_offset;
+				if((line_end != line) && (line_end[-1] == '\r')){
+					--line_end;
+				}
+				// 空行可能导致回调函数被调用，先丢弃。非空行在解析完成之后丢弃。
+				if(line_end == line){
+					m_queue.discard(line_total);
+					line_total = 0;
+				}
+			} else {
+				if(m_queue.size() < m_size_expecting){
+					break;
+				}
+				expected = m_queue.cut_off(m_size_expecting);
 			}
 
 			switch(m_state){
 				boost::uint64_t temp64;
+				const char *pos;
 
 			case S_FIRST_HEADER:
-				if(!expected.empty()){
+				if(line != line_end){
 					m_request_headers = RequestHeaders();
 					m_content_length = 0;
 					m_content_offset = 0;
 
-					std::string line;
-					expected.dump(line);
-
-					AUTO(pos, line.find(' '));
-					if(pos == std::string::npos){
-						LOG_POSEIDON_WARNING("Bad request header: expecting verb, line = ", line);
+					pos = static_cast<const char *>(std::memchr(line, ' ', static_cast<std::size_t>(line_end - line)));
+					if(!pos){
+						LOG_POSEIDON_WARNING("Bad request header: expecting verb, line = ", std::string(line, line_end));
 						DEBUG_THROW(Exception, ST_BAD_REQUEST);
 					}
-					line[pos] = 0;
-					m_request_headers.verb = get_verb_from_string(line.c_str());
+					m_request_headers.verb = get_verb_from_string(line, static_cast<std::size_t>(pos - line));
 					if(m_request_headers.verb == V_INVALID_VERB){
-						LOG_POSEIDON_WARNING("Bad verb: ", line.c_str());
+						LOG_POSEIDON_WARNING("Bad verb: ", std::string(line, pos));
 						DEBUG_THROW(Exception, ST_NOT_IMPLEMENTED);
 					}
-					line.erase(0, pos + 1);
+					const AUTO(uri_begin, pos + 1);
 
-					pos = line.find(' ');
-					if(pos == std::string::npos){
-						LOG_POSEIDON_WARNING("Bad request header: expecting URI end, line = ", line);
+					pos = static_cast<const char *>(std::memchr(uri_begin, ' ', static_cast<std::size_t>(line_end - uri_begin)));
+					if(!pos){
+						LOG_POSEIDON_WARNING("Bad request header: expecting URI end, line = ", std::string(line, line_end));
 						DEBUG_THROW(Exception, ST_BAD_REQUEST);
 					}
-					m_request_headers.uri.assign(line, 0, pos);
-					line.erase(0, pos + 1);
+					const AUTO(uri_end, pos);
 
-					long ver_end = 0;
-					char ver_major_str[16], ver_minor_str[16];
-					if(std::sscanf(line.c_str(), "HTTP/%15[0-9].%15[0-9]%ln", ver_major_str, ver_minor_str, &ver_end) != 2){
-						LOG_POSEIDON_WARNING("Bad request header: expecting HTTP version, line = ", line);
-						DEBUG_THROW(Exception, ST_BAD_REQUEST);
-					}
-					if(static_cast<unsigned long>(ver_end) != line.size()){
-						LOG_POSEIDON_WARNING("Bad request header: junk after HTTP version, line = ", line);
+					if(!parse_http_version(m_request_headers.version, uri_end + 1, line_end)){
+						LOG_POSEIDON_WARNING("Bad request header: expecting HTTP version, line = ", std::string(line, line_end));
 						DEBUG_THROW(Exception, ST_BAD_REQUEST);
 					}
-					m_request_headers.version = std::strtoul(ver_major_str, NULLPTR, 10) * 10000 + std::strtoul(ver_minor_str, NULLPTR, 10);
 					if((m_request_headers.version != 10000) && (m_request_headers.version != 10001)){
-						LOG_POSEIDON_WARNING("Bad request header: HTTP version not supported, ver_major_str = ", ver_major_str,
-							", ver_minor_str = ", ver_minor_str);
+						LOG_POSEIDON_WARNING("Bad request header: HTTP version not supported, line = ", std::string(line, line_end));
 						DEBUG_THROW(Exception, ST_VERSION_NOT_SUPPORTED);
 					}
 
-					if(!dont_parse_get_params){
-						pos = m_request_headers.uri.find('?');
-						if(pos != std::string::npos){
-							m_request_headers.get_params = optional_map_from_url_encoded(m_request_headers.uri.substr(pos + 1));
-							m_request_headers.uri.erase(pos);
-						}
+					pos = dont_parse_get_params ? NULLPTR
+						: static_cast<const char *>(std::memchr(uri_begin, '?', static_cast<std::size_t>(uri_end - uri_begin)));
+					if(pos){
+						m_request_headers.uri.assign(uri_begin, pos);
+						m_request_headers.get_params = optional_map_from_url_encoded(std::string(pos + 1, uri_end));
+					} else {
+						m_request_headers.uri.assign(uri_begin, uri_end);
 					}
 
 					m_size_expecting = EXPECTING_NEW_LINE;
@@ -132,16 +199,14 @@ namespace Http {
 				break;
 
 			case S_HEADERS:
-				if(!expected.empty()){
-					std::string line;
-					expected.dump(line);
-
-					AUTO(pos, line.find(':'));
-					if(pos == std::string::npos){
-						LOG_POSEIDON_WARNING("Invalid HTTP header: line = ", line);
+				if(line != line_end){
+					pos = static_cast<const char *>(std::memchr(line, ':', static_cast<std::size_t>(line_end - line)));
+					if(!pos){
+						LOG_POSEIDON_WARNING("Invalid HTTP header: line = ", std::string(line, line_end));
 						DEBUG_THROW(Exception, ST_BAD_REQUEST);
 					}
-					m_request_headers.headers.append(SharedNts(line.data(), pos), ltrim(line.substr(pos + 1)));
+					m_request_headers.headers.append(intern_header_name(line, static_cast<std::size_t>(pos - line)),
+						std::string(skip_spaces(pos + 1, line_end), line_end));
 
 					m_size_expecting = EXPECTING_NEW_LINE;
 					// m_state = S_HEADERS;
@@ -203,22 +268,32 @@ namespace Http {
 				break;
 
 			case S_CHUNK_HEADER:
-				if(!expected.empty()){
+				if(line != line_end){
 					m_chunk_size = 0;
 					m_chunk_offset = 0;
 					m_chunked_trailer.clear();
 
-					std::string line;
-					expected.dump(line);
-
-					char *endptr;
-					m_chunk_size = ::strtoull(line.c_str(), &endptr, 16);
-					if(*endptr && (*endptr != ' ')){
-						LOG_POSEIDON_WARNING("Bad chunk header: ", line);
+					pos = line;
+					temp64 = 0;
+					while(pos != line_end){
+						const int digit = get_hex_digit(*pos);
+						if(digit < 0){
+							break;
+						}
+						if(temp64 > (CONTENT_LENGTH_MAX >> 4)){
+							LOG_POSEIDON_WARNING("Inacceptable chunk size in header: ", std::string(line, line_end));
+							DEBUG_THROW(Exception, ST_REQUEST_ENTITY_TOO_LARGE);
+						}
+						temp64 = (temp64 << 4) | static_cast<unsigned>(digit);
+						++pos;
+					}
+					if((pos == line) || ((pos != line_end) && (*pos != ' '))){
+						LOG_POSEIDON_WARNING("Bad chunk header: ", std::string(line, line_end));
 						DEBUG_THROW(Exception, ST_BAD_REQUEST);
 					}
+					m_chunk_size = temp64;
 					if(m_chunk_size > CONTENT_LENGTH_MAX){
-						LOG_POSEIDON_WARNING("Inacceptable chunk size in header: ", line);
+						LOG_POSEIDON_WARNING("Inacceptable chunk size in header: ", std::string(line, line_end));
 						DEBUG_THROW(Exception, ST_REQUEST_ENTITY_TOO_LARGE);
 					}
 					if(m_chunk_size == 0){
@@ -251,16 +326,14 @@ namespace Http {
 				break;
 
 			case S_CHUNKED_TRAILER:
-				if(!expected.empty()){
-					std::string line;
-					expected.dump(line);
-
-					AUTO(pos, line.find(':'));
-					if(pos == std::string::npos){
-						LOG_POSEIDON_WARNING("Invalid chunk trailer: line = ", line);
+				if(line != line_end){
+					pos = static_cast<const char *>(std::memchr(line, ':', static_cast<std::size_t>(line_end - line)));
+					if(!pos){
+						LOG_POSEIDON_WARNING("Invalid chunk trailer: line = ", std::string(line, line_end));
 						DEBUG_THROW(Exception, ST_BAD_REQUEST);
 					}
-					m_chunked_trailer.append(SharedNts(line.data(), pos), ltrim(line.substr(pos + 1)));
+					m_chunked_trailer.append(intern_header_name(line, static_cast<std::size_t>(pos - line)),
+						std::string(skip_spaces(pos + 1, line_end), line_end));
 
 					m_size_expecting = EXPECTING_NEW_LINE;
 					// m_state = S_CHUNKED_TRAILER;
@@ -276,6 +349,10 @@ namespace Http {
 				LOG_POSEIDON_ERROR("Unknown state: ", static_cast<unsigned>(m_state));
 				std::abort();
 			}
+
+			if(line_total != 0){
+				m_queue.discard(line_total);
+			}
 		} while(has_next_request);
 
 		return has_next_request;
@@ -39,9 +39,13 @@ namespace Http {
 
 	private:
 		StreamBuffer m_queue;
+		// 跨越多个块的行被复制到这里再解析。
+		std::string m_line;
 
 		boost::uint64_t m_size_expecting;
 		State m_state;
+		// 已经解析的请求行、报头和 chunked trailer 的总字节数（包含换行符和空行），只增不减。
+		boost::uint64_t m_header_size_total;
 
 		RequestHeaders m_request_headers;
 		boost::uint64_t m_content_length;
@@ -73,6 +77,9 @@ namespace Http {
 		StreamBuffer &get_queue(){
 			return m_queue;
 		}
+		boost::uint64_t get_header_size_total() const {
+			return m_header_size_total;
+		}
 
 		bool put_encoded_data(StreamBuffer encoded, bool dont_parse_get_params = false);
 	};
@@ -3,6 +3,7 @@
 
 #include "../precompiled.hpp"
 #include "server_writer.hpp"
+#include "header_template.hpp"
 #include "const_strings.hpp"
 #include "exception.hpp"
 #include "utilities.hpp"
@@ -13,6 +14,166 @@
 namespace Poseidon {
 
 namespace Http {
+	namespace {
+		// 从 end 开始向前写入，返回第一个字符的位置。缓冲区至少要有 20 个字节。
+		char *format_decimal_backward(char *end, boost::uint64_t val){
+			char *begin = end;
+			do {
+				*--begin = static_cast<char>('0' + val % 10);
+				val /= 10;
+			} while(val != 0);
+			return begin;
+		}
+		char *format_hex_backward(char *end, boost::uint64_t val){
+			static const char HEX_TABLE[] = "0123456789abcdef";
+
+			char *begin = end;
+			do {
+				*--begin = HEX_TABLE[val & 0x0F];
+				val >>= 4;
+			} while(val != 0);
+			return begin;
+		}
+
+		// 先在栈上拼接，满了再写入 StreamBuffer，避免每个字段都调用一次 StreamBuffer::put()。
+		class Encoder : NONCOPYABLE {
+		private:
+			StreamBuffer &m_data;
+			std::size_t m_size;
+			char m_buffer[1024];
+
+		public:
+			explicit Encoder(StreamBuffer &data)
+				: m_data(data), m_size(0)
+			{
+			}
+
+		public:
+			void put(const char *str, std::size_t len){
+				if(len > sizeof(m_buffer) - m_size){
+					flush();
+					if(len > sizeof(m_buffer)){
+						m_data.put(str, len);
+						return;
+					}
+				}
+				std::memcpy(m_buffer + m_size, str, len);
+				m_size += len;
+			}
+			void put(const char *str){
+				put(str, std::strlen(str));
+			}
+			void put(const std::string &str){
+				put(str.data(), str.size());
+			}
+			void put_decimal(boost::uint64_t val){
+				char temp[24];
+				char *const end = temp + sizeof(temp);
+				const AUTO(begin, format_decimal_backward(end, val));
+				put(begin, static_cast<std::size_t>(end - begin));
+			}
+			void put_hex(boost::uint64_t val){
+				char temp[24];
+				char *const end = temp + sizeof(temp);
+				const AUTO(begin, format_hex_backward(end, val));
+				put(begin, static_cast<std::size_t>(end - begin));
+			}
+
+			void put_status_line(const ResponseHeaders &response_headers){
+				const AUTO(line, get_encoded_status_line(response_headers.version, response_headers.status_code, response_headers.reason));
+				if(line){
+					put(*line);
+					return;
+				}
+				put("HTTP/", 5);
+				put_decimal(response_headers.version / 10000);
+				put(".", 1);
+				put_decimal(response_headers.version % 10000);
+				put(" ", 1);
+				put_decimal(response_headers.status_code);
+				put(" ", 1);
+				put(response_headers.reason);
+				put("\r\n", 2);
+			}
+			void put_headers(const OptionalMap &headers){
+				for(AUTO(it, headers.begin()); it != headers.end(); ++it){
+					put(it->first.get());
+					put(": ", 2);
+					put(it->second);
+					put("\r\n", 2);
+				}
+			}
+
+			void flush(){
+				if(m_size != 0){
+					m_data.put(m_buffer, m_size);
+					m_size = 0;
+				}
+			}
+		};
+
+		std::string get_normalized_transfer_encoding(const OptionalMap &headers){
+			AUTO(transfer_encoding, headers.get("Transfer-Encoding"));
+			AUTO(pos, transfer_encoding.find(';'));
+			if(pos != std::string::npos){
+				transfer_encoding.erase(pos);
+			}
+			return to_lower_case(trim(STD_MOVE(transfer_encoding)));
+		}
+
+		void encode_response(StreamBuffer &data, ResponseHeaders &response_headers, const HeaderTemplate *header_template, StreamBuffer &entity){
+			Encoder encoder(data);
+			encoder.put_status_line(response_headers);
+
+			AUTO_REF(headers, response_headers.headers);
+			if(entity.empty()){
+				headers.erase("Content-Type");
+				headers.erase("Transfer-Encoding");
+				headers.set(sslit("Content-Length"), STR_0);
+			} else {
+				const AUTO(transfer_encoding, get_normalized_transfer_encoding(headers));
+				if(transfer_encoding.empty() || (transfer_encoding == STR_IDENTITY)){
+					char temp[24];
+					char *const end = temp + sizeof(temp);
+					const AUTO(begin, format_decimal_backward(end, entity.size()));
+					headers.set(sslit("Content-Length"), std::string(begin, end));
+				} else {
+					// 只有一个 chunk。
+					StreamBuffer chunk;
+					Encoder chunk_encoder(chunk);
+					chunk_encoder.put_hex(entity.size());
+					chunk_encoder.put("\r\n", 2);
+					chunk_encoder.flush();
+					chunk.splice(entity);
+					chunk.put("\r\n0\r\n\r\n");
+					entity.swap(chunk);
+				}
+			}
+			if(header_template){
+				const AUTO_REF(template_headers, header_template->get_headers());
+				for(AUTO(it, headers.begin()); it != headers.end(); ++it){
+					if(template_headers.has(it->first)){
+						LOG_POSEIDON_ERROR("HTTP header duplicated in both response and template: ", it->first);
+						DEBUG_THROW(BasicException, sslit("HTTP header duplicated in both response and template"));
+					}
+				}
+			}
+			encoder.put_headers(headers);
+			if(header_template){
+				// 模板以空行结尾。没有正文时不发送模板中的 Content-Type，和不使用模板时一致。
+				encoder.flush();
+				StreamBuffer encoded(entity.empty() ? header_template->get_encoded_without_entity()
+				                                    : header_template->get_encoded());
+				data.splice(encoded);
+			} else {
+				encoder.put("\r\n", 2);
+				encoder.flush();
+			}
+
+			data.splice(entity);
+		}
+	}
+
 	ServerWriter::ServerWriter(){
 	}
 	ServerWriter::~ServerWriter(){
@@ -23,22 +184,11 @@ namespace Http {
 
 		StreamBuffer data;
 
-		const unsigned ver_major = response_headers.version / 10000, ver_minor = response_headers.version % 10000;
-		const unsigned status_code = static_cast<unsigned>(response_headers.status_code);
-		char temp[64];
-		unsigned len = (unsigned)std::sprintf(temp, "HTTP/%u.%u %u ", ver_major, ver_minor, status_code);
-		data.put(temp, len);
-		data.put(response_headers.reason);
-		data.put("\r\n");
-
-		AUTO_REF(headers, response_headers.headers);
-		for(AUTO(it, headers.begin()); it != headers.end(); ++it){
-			data.put(it->first.get());
-			data.put(": ");
-			data.put(it->second);
-			data.put("\r\n");
-		}
-		data.put("\r\n");
+		Encoder encoder(data);
+		encoder.put_status_line(response_headers);
+		encoder.put_headers(response_headers.headers);
+		encoder.put("\r\n", 2);
+		encoder.flush();
 
 		return on_encoded_data_avail(STD_MOVE(data));
 	}
@@ -52,49 +202,15 @@ namespace Http {
 		PROFILE_ME;
 
 		StreamBuffer data;
+		encode_response(data, response_headers, NULLPTR, entity);
 
-		const unsigned ver_major = response_headers.version / 10000, ver_minor = response_headers.version % 10000;
-		const unsigned status_code = static_cast<unsigned>(response_headers.status_code);
-		char temp[64];
-		unsigned len = (unsigned)std::sprintf(temp, "HTTP/%u.%u %u ", ver_major, ver_minor, status_code);
-		data.put(temp, len);
-		data.put(response_headers.reason);
-		data.put("\r\n");
-
-		AUTO_REF(headers, response_headers.headers);
-		if(entity.empty()){
-			headers.erase("Content-Type");
-			headers.erase("Transfer-Encoding");
-			headers.set(sslit("Content-Length"), STR_0);
-		} else {
-			AUTO(transfer_encoding, headers.get("Transfer-Encoding"));
-			AUTO(pos, transfer_encoding.find(';'));
-			if(pos != std::string::npos){
-				transfer_encoding.erase(pos);
-			}
-			transfer_encoding = to_lower_case(trim(STD_MOVE(transfer_encoding)));
-
-			if(transfer_encoding.empty() || (transfer_encoding == STR_IDENTITY)){
-				headers.set(sslit("Content-Length"), boost::lexical_cast<std::string>(entity.size()));
-			} else {
-				// 只有一个 chunk。
-				StreamBuffer chunk;
-				len = (unsigned)std::sprintf(temp, "%llx\r\n", (unsigned long long)entity.size());
-				chunk.put(temp, len);
-				chunk.splice(entity);
-				chunk.put("\r\n0\r\n\r\n");
-				entity.swap(chunk);
-			}
-		}
-		for(AUTO(it, headers.begin()); it != headers.end(); ++it){
-			data.put(it->first.get());
-			data.put(": ");
-			data.put(it->second);
-			data.put("\r\n");
-		}
-		data.put("\r\n");
+		return on_encoded_data_avail(STD_MOVE(data));
+	}
+	long ServerWriter::put_response(ResponseHeaders response_headers, const HeaderTemplate &header_template, StreamBuffer entity){
+		PROFILE_ME;
 
-		data.splice(entity);
+		StreamBuffer data;
+		encode_response(data, response_headers, &header_template, entity);
 
 		return on_encoded_data_avail(STD_MOVE(data));
 	}
@@ -126,36 +242,20 @@ namespace Http {
 
 		StreamBuffer data;
 
-		const unsigned ver_major = response_headers.version / 10000, ver_minor = response_headers.version % 10000;
-		const unsigned status_code = static_cast<unsigned>(response_headers.status_code);
-		char temp[64];
-		unsigned len = (unsigned)std::sprintf(temp, "HTTP/%u.%u %u ", ver_major, ver_minor, status_code);
-		data.put(temp, len);
-		data.put(response_headers.reason);
-		data.put("\r\n");
-
 		AUTO_REF(headers, response_headers.headers);
 
-		AUTO(transfer_encoding, headers.get("Transfer-Encoding"));
-		AUTO(pos, transfer_encoding.find(';'));
-		if(pos != std::string::npos){
-			transfer_encoding.erase(pos);
-		}
-		transfer_encoding = to_lower_case(trim(STD_MOVE(transfer_encoding)));
-
+		AUTO(transfer_encoding, get_normalized_transfer_encoding(headers));
 		if(transfer_encoding.empty() || (transfer_encoding == STR_IDENTITY)){
 			headers.set(sslit("Transfer-Encoding"), STR_CHUNKED);
 		} else {
 			headers.set(sslit("Transfer-Encoding"), STD_MOVE(transfer_encoding));
 		}
 
-		for(AUTO(it, headers.begin()); it != headers.end(); ++it){
-			data.put(it->first.get());
-			data.put(": ");
-			data.put(it->second);
-			data.put("\r\n");
-		}
-		data.put("\r\n");
+		Encoder encoder(data);
+		encoder.put_status_line(response_headers);
+		encoder.put_headers(headers);
+		encoder.put("\r\n", 2);
+		encoder.flush();
 
 		return on_encoded_data_avail(STD_MOVE(data));
 	}
@@ -169,9 +269,10 @@ namespace Http {
 
 		StreamBuffer chunk;
 
-		char temp[64];
-		unsigned len = (unsigned)std::sprintf(temp, "%llx\r\n", (unsigned long long)entity.size());
-		chunk.put(temp, len);
+		Encoder encoder(chunk);
+		encoder.put_hex(entity.size());
+		encoder.put("\r\n", 2);
+		encoder.flush();
 		chunk.splice(entity);
 		chunk.put("\r\n");
 
@@ -182,14 +283,11 @@ namespace Http {
 
 		StreamBuffer data;
 
-		data.put("0\r\n");
-		for(AUTO(it, headers.begin()); it != headers.end(); ++it){
-			data.put(it->first.get());
-			data.put(": ");
-			data.put(it->second);
-			data.put("\r\n");
-		}
-		data.put("\r\n");
+		Encoder encoder(data);
+		encoder.put("0\r\n", 3);
+		encoder.put_headers(headers);
+		encoder.put("\r\n", 2);
+		encoder.flush();
 
 		return on_encoded_data_avail(STD_MOVE(data));
 	}
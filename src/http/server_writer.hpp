@@ -14,6 +14,8 @@
 namespace Poseidon {
 
 namespace Http {
+	class HeaderTemplate;
+
 	class ServerWriter {
 	public:
 		ServerWriter();
@@ -27,6 +29,8 @@ namespace Http {
 		long put_entity(StreamBuffer data);
 
 		long put_response(ResponseHeaders response_headers, StreamBuffer entity);
+		// 使用预先编码的头部模板。response_headers 中的字段排在模板之前，二者不应有重复。
+		long put_response(ResponseHeaders response_headers, const HeaderTemplate &header_template, StreamBuffer entity);
 		long put_default_response(ResponseHeaders response_headers);
 
 		long put_chunked_header(ResponseHeaders response_headers);
@@ -11,6 +11,7 @@
 #include "../singletons/job_dispatcher.hpp"
 #include "../stream_buffer.hpp"
 #include "../job_base.hpp"
+#include "../atomic.hpp"
 
 namespace Poseidon {
 
@@ -26,6 +27,11 @@ namespace Http {
 		{
 		}
 
+	protected:
+		const boost::weak_ptr<Session> &get_weak_session() const {
+			return m_session;
+		}
+
 	private:
 		boost::weak_ptr<const void> get_category() const FINAL {
 			return m_session;
@@ -103,6 +109,15 @@ namespace Http {
 			, m_transfer_encoding(STD_MOVE(transfer_encoding)), m_entity(STD_MOVE(entity))
 		{
 		}
+		~RequestJob(){
+			// 无论请求是否被处理，都要归还流水线的名额。
+			const AUTO(session, get_weak_session().lock());
+			if(!session){
+				return;
+			}
+			atomic_sub(session->m_pending_request_count, 1, ATOMIC_SEQ_CST);
+			session->resume_reading_if_possible();
+		}
 
 	protected:
 		void really_perform(const boost::shared_ptr<Session> &session) OVERRIDE {
@@ -122,29 +137,181 @@ namespace Http {
 		}
 	};
 
+	class Session::StreamHeadersJob : public Session::SyncJobBase {
+	private:
+		RequestHeaders m_request_headers;
+		boost::uint64_t m_content_length;
+
+	public:
+		StreamHeadersJob(const boost::shared_ptr<Session> &session,
+			RequestHeaders request_headers, boost::uint64_t content_length)
+			: SyncJobBase(session)
+			, m_request_headers(STD_MOVE(request_headers)), m_content_length(content_length)
+		{
+		}
+
+	protected:
+		void really_perform(const boost::shared_ptr<Session> &session) OVERRIDE {
+			PROFILE_ME;
+
+			session->on_sync_request_headers(STD_MOVE(m_request_headers), m_content_length);
+		}
+	};
+
+	class Session::StreamEntityJob : public Session::SyncJobBase {
+	private:
+		const boost::uint64_t m_size;
+
+		boost::uint64_t m_entity_offset;
+		StreamBuffer m_entity;
+
+	public:
+		StreamEntityJob(const boost::shared_ptr<Session> &session,
+			boost::uint64_t entity_offset, StreamBuffer entity)
+			: SyncJobBase(session)
+			, m_size(entity.size())
+			, m_entity_offset(entity_offset), m_entity(STD_MOVE(entity))
+		{
+		}
+		~StreamEntityJob(){
+			const AUTO(session, get_weak_session().lock());
+			if(!session){
+				return;
+			}
+			atomic_sub(session->m_pending_stream_bytes, m_size, ATOMIC_SEQ_CST);
+			session->resume_reading_if_possible();
+		}
+
+	protected:
+		void really_perform(const boost::shared_ptr<Session> &session) OVERRIDE {
+			PROFILE_ME;
+
+			session->on_sync_request_entity(m_entity_offset, STD_MOVE(m_entity));
+		}
+	};
+
+	class Session::StreamEndJob : public Session::SyncJobBase {
+	private:
+		boost::uint64_t m_content_length;
+		OptionalMap m_trailer;
+		bool m_keep_alive;
+
+	public:
+		StreamEndJob(const boost::shared_ptr<Session> &session,
+			boost::uint64_t content_length, OptionalMap trailer, bool keep_alive)
+			: SyncJobBase(session)
+			, m_content_length(content_length), m_trailer(STD_MOVE(trailer)), m_keep_alive(keep_alive)
+		{
+		}
+		~StreamEndJob(){
+			const AUTO(session, get_weak_session().lock());
+			if(!session){
+				return;
+			}
+			atomic_sub(session->m_pending_request_count, 1, ATOMIC_SEQ_CST);
+			session->resume_reading_if_possible();
+		}
+
+	protected:
+		void really_perform(const boost::shared_ptr<Session> &session) OVERRIDE {
+			PROFILE_ME;
+
+			session->on_sync_request_end(m_content_length, STD_MOVE(m_trailer));
+
+			if(m_keep_alive){
+				const AUTO(keep_alive_timeout, MainConfig::get<boost::uint64_t>("http_keep_alive_timeout", 5000));
+				session->set_timeout(keep_alive_timeout);
+			} else {
+				session->shutdown_read();
+				session->shutdown_write();
+			}
+		}
+	};
+
 	Session::Session(UniqueFile socket, boost::uint64_t max_request_length)
 		: LowLevelSession(STD_MOVE(socket))
 		, m_max_request_length(max_request_length ? max_request_length
 		                                          : MainConfig::get<boost::uint64_t>("http_max_request_length", 16384))
-		, m_size_total(0), m_request_headers()
+		, m_max_pipelining_depth(MainConfig::get<std::size_t>("http_max_pipelining_depth", 16))
+		, m_stream_high_water(MainConfig::get<boost::uint64_t>("http_stream_high_water", 1048576))
+		, m_stream_low_water(MainConfig::get<boost::uint64_t>("http_stream_low_water", 262144))
+		, m_pending_request_count(0), m_pending_stream_bytes(0)
+		, m_size_total(0), m_header_size_base(0), m_request_headers(), m_streaming(false), m_entity_offset(0)
 	{
 	}
 	Session::~Session(){
 	}
 
+	bool Session::can_resume_reading() const NOEXCEPT {
+		if((m_max_pipelining_depth != 0) && (atomic_load(m_pending_request_count, ATOMIC_SEQ_CST) >= m_max_pipelining_depth)){
+			return false;
+		}
+		if(atomic_load(m_pending_stream_bytes, ATOMIC_SEQ_CST) > m_stream_low_water){
+			return false;
+		}
+		return true;
+	}
+	// 使用 set_read_paused() 而不是 set_throttled()，不会解除用户自己设置的节流。
+	void Session::pause_reading_if_needed() NOEXCEPT {
+		const AUTO(pending_count, atomic_load(m_pending_request_count, ATOMIC_SEQ_CST));
+		const AUTO(pending_bytes, atomic_load(m_pending_stream_bytes, ATOMIC_SEQ_CST));
+		if(((m_max_pipelining_depth == 0) || (pending_count < m_max_pipelining_depth)) && (pending_bytes <= m_stream_high_water)){
+			return;
+		}
+		LOG_POSEIDON_DEBUG("Pausing HTTP session: pending_count = ", pending_count, ", pending_bytes = ", pending_bytes);
+		set_read_paused(true);
+		// 任务可能在此之前已经完成了，这时不会有人再恢复读取。
+		if(can_resume_reading()){
+			set_read_paused(false);
+		}
+	}
+	void Session::resume_reading_if_possible() NOEXCEPT {
+		if(can_resume_reading()){
+			set_read_paused(false);
+		}
+	}
+
+	void Session::enqueue_request_job(const boost::shared_ptr<JobBase> &job){
+		PROFILE_ME;
+
+		// 名额在任务析构时归还，所以要在任务创建之后再占用。
+		atomic_add(m_pending_request_count, 1, ATOMIC_SEQ_CST);
+		JobDispatcher::enqueue(job, VAL_INIT);
+		pause_reading_if_needed();
+	}
+	void Session::flush_stream_entity(){
+		PROFILE_ME;
+
+		if(m_entity.empty()){
+			return;
+		}
+		// 每次读取只派发一个任务，不必为 ServerReader 切出的每一小块都派发一个。
+		const boost::uint64_t size = m_entity.size();
+		const AUTO(job, boost::make_shared<StreamEntityJob>(
+			virtual_shared_from_this<Session>(), m_entity_offset, STD_MOVE(m_entity)));
+		m_entity.clear();
+		atomic_add(m_pending_stream_bytes, size, ATOMIC_SEQ_CST);
+		JobDispatcher::enqueue(job, VAL_INIT);
+		pause_reading_if_needed();
+	}
+
 	void Session::on_read_avail(StreamBuffer data)
 	try {
 		PROFILE_ME;
 
-		const AUTO(upgraded_session, get_low_level_upgraded_session());
-		if(!upgraded_session){
-			m_size_total += data.size();
-			if(m_size_total > m_max_request_length){
+		LowLevelSession::on_read_avail(STD_MOVE(data));
+
+		if(m_streaming){
+			flush_stream_entity();
+		}
+
+		// 客户端可能在一个报文中发送多个请求，已经解析过的不能计入当前请求的长度。
+		// 因为流水线已满而暂停解析时，队列中是尚未解析的后续请求，不在这里检查。
+		if(!get_low_level_upgraded_session() && !is_read_paused()){
+			if(get_low_level_size_total() + get_low_level_queue_size() > m_max_request_length){
 				DEBUG_THROW(Exception, ST_REQUEST_ENTITY_TOO_LARGE);
 			}
 		}
-
-		LowLevelSession::on_read_avail(STD_MOVE(data));
 	} catch(Exception &e){
 		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
 			"Http::Exception thrown in HTTP parser: status_code = ", e.get_status_code(), ", what = ", e.what());
@@ -158,11 +325,12 @@ namespace Http {
 	{
 		PROFILE_ME;
 
-		(void)content_length;
-
 		m_size_total = 0;
+		m_header_size_base = get_low_level_header_size_total();
 		m_request_headers = STD_MOVE(request_headers);
 		m_transfer_encoding = STD_MOVE(transfer_encoding);
+		m_streaming = is_request_streamed(m_request_headers, content_length);
+		m_entity_offset = 0;
 		m_entity.clear();
 
 		const AUTO_REF(expect, m_request_headers.headers.get("Expect"));
@@ -175,13 +343,30 @@ namespace Http {
 				LOG_POSEIDON_DEBUG("Unknown HTTP header Expect: ", expect);
 			}
 		}
+
+		if(m_streaming){
+			JobDispatcher::enqueue(
+				boost::make_shared<StreamHeadersJob>(virtual_shared_from_this<Session>(), m_request_headers, content_length),
+				VAL_INIT);
+		}
 	}
 	void Session::on_low_level_request_entity(boost::uint64_t entity_offset, bool is_chunked, StreamBuffer entity){
 		PROFILE_ME;
 
-		(void)entity_offset;
 		(void)is_chunked;
 
+		if(m_streaming){
+			if(m_entity.empty()){
+				m_entity_offset = entity_offset;
+			}
+			m_entity.splice(entity);
+			return;
+		}
+
+		m_size_total += entity.size();
+		if(get_low_level_size_total() > m_max_request_length){
+			DEBUG_THROW(Exception, ST_REQUEST_ENTITY_TOO_LARGE);
+		}
 		m_entity.splice(entity);
 	}
 	boost::shared_ptr<UpgradedSessionBase> Session::on_low_level_request_end(
@@ -189,9 +374,23 @@ namespace Http {
 	{
 		PROFILE_ME;
 
-		(void)content_length;
 		(void)is_chunked;
 
+		if(m_streaming){
+			const AUTO(keep_alive, is_keep_alive_enabled(m_request_headers));
+			if(!keep_alive){
+				shutdown_read();
+			}
+
+			flush_stream_entity();
+			m_streaming = false;
+
+			// 同一个连接的任务按顺序执行，因此响应的顺序和请求一致。
+			enqueue_request_job(boost::make_shared<StreamEndJob>(
+				virtual_shared_from_this<Session>(), content_length, STD_MOVE(headers), keep_alive));
+			return VAL_INIT;
+		}
+
 		for(AUTO(it, headers.begin()); it != headers.end(); ++it){
 			m_request_headers.headers.append(it->first, STD_MOVE(it->second));
 		}
@@ -199,13 +398,32 @@ namespace Http {
 			shutdown_read();
 		}
 
-		JobDispatcher::enqueue(
-			boost::make_shared<RequestJob>(
-				virtual_shared_from_this<Session>(), STD_MOVE(m_request_headers), STD_MOVE(m_transfer_encoding), STD_MOVE(m_entity)),
-			VAL_INIT);
-
+		// 同一个连接的任务按顺序执行，因此响应的顺序和请求一致。
+		enqueue_request_job(boost::make_shared<RequestJob>(
+			virtual_shared_from_this<Session>(), STD_MOVE(m_request_headers), STD_MOVE(m_transfer_encoding), STD_MOVE(m_entity)));
 		return VAL_INIT;
 	}
+
+	bool Session::is_request_streamed(const RequestHeaders &request_headers, boost::uint64_t content_length) const {
+		(void)request_headers;
+		(void)content_length;
+
+		return false;
+	}
+	void Session::on_sync_request_headers(RequestHeaders request_headers, boost::uint64_t content_length){
+		(void)request_headers;
+		(void)content_length;
+	}
+	void Session::on_sync_request_entity(boost::uint64_t entity_offset, StreamBuffer entity){
+		(void)entity_offset;
+		(void)entity;
+	}
+	void Session::on_sync_request_end(boost::uint64_t content_length, OptionalMap trailer){
+		(void)content_length;
+		(void)trailer;
+
+		DEBUG_THROW(Exception, ST_NOT_IMPLEMENTED);
+	}
 }
 
 }
@@ -5,9 +5,13 @@
 #define POSEIDON_HTTP_SESSION_HPP_
 
 #include "low_level_session.hpp"
+#include <cstddef>
+#include <boost/shared_ptr.hpp>
 
 namespace Poseidon {
 
+class JobBase;
+
 namespace Http {
 	class Session : public LowLevelSession {
 	private:
@@ -15,22 +19,46 @@ namespace Http {
 		class ContinueJob;
 		class RequestJob;
 		class ErrorJob;
+		class StreamHeadersJob;
+		class StreamEntityJob;
+		class StreamEndJob;
 
 	private:
 		const boost::uint64_t m_max_request_length;
+		const std::size_t m_max_pipelining_depth;
+		const boost::uint64_t m_stream_high_water;
+		const boost::uint64_t m_stream_low_water;
+
+		// 已经派发但尚未完成的请求数。达到 m_max_pipelining_depth 时暂停读取。
+		volatile std::size_t m_pending_request_count;
+		// 流式请求中已经派发但尚未处理的正文字节数。超过 m_stream_high_water 时暂停读取，
+		// 降到 m_stream_low_water 以下时恢复。
+		volatile boost::uint64_t m_pending_stream_bytes;
 
+		// 当前请求的正文长度。报头和 trailer 的长度由 get_low_level_header_size_total() 减去 m_header_size_base 得到。
 		boost::uint64_t m_size_total;
+		boost::uint64_t m_header_size_base;
 		RequestHeaders m_request_headers;
 		std::string m_transfer_encoding;
+		bool m_streaming;
+		boost::uint64_t m_entity_offset;
 		StreamBuffer m_entity;
 
 	public:
 		explicit Session(UniqueFile socket, boost::uint64_t max_request_length = 0);
 		~Session();
 
+	private:
+		bool can_resume_reading() const NOEXCEPT;
+		void pause_reading_if_needed() NOEXCEPT;
+		void resume_reading_if_possible() NOEXCEPT;
+
+		void enqueue_request_job(const boost::shared_ptr<JobBase> &job);
+		void flush_stream_entity();
+
 	protected:
 		boost::uint64_t get_low_level_size_total() const {
-			return m_size_total;
+			return m_size_total + (get_low_level_header_size_total() - m_header_size_base);
 		}
 		const RequestHeaders &get_low_level_request_headers() const {
 			return m_request_headers;
@@ -53,6 +81,15 @@ namespace Http {
 
 		// 可覆写。
 		virtual void on_sync_request(RequestHeaders request_headers, StreamBuffer entity) = 0;
+
+		// 流式请求。在 epoll 线程中调用，不要阻塞。返回 true 则这个请求的正文不会被缓存，也不受 http_max_request_length 限制，
+		// 依次调用 on_sync_request_headers()、若干次 on_sync_request_entity() 和 on_sync_request_end()，不调用 on_sync_request()。
+		virtual bool is_request_streamed(const RequestHeaders &request_headers, boost::uint64_t content_length) const;
+		// content_length 的含义同 ServerReader::on_request_headers()。
+		virtual void on_sync_request_headers(RequestHeaders request_headers, boost::uint64_t content_length);
+		virtual void on_sync_request_entity(boost::uint64_t entity_offset, StreamBuffer entity);
+		// 在这里发送响应。trailer 是 chunked 编码中追加的报头。
+		virtual void on_sync_request_end(boost::uint64_t content_length, OptionalMap trailer);
 	};
 }
 
@@ -148,6 +148,26 @@ namespace Http {
 					"The server does not support, or refuses to support, the HTTP "
 					"protocol version that was used in the request message." },
 		};
+
+		const std::size_t DESC_COUNT = sizeof(DESC_TABLE) / sizeof(DESC_TABLE[0]);
+
+		// 下标与 DESC_TABLE 相同。[0] 是 HTTP/1.0，[1] 是 HTTP/1.1。
+		struct EncodedStatusLines {
+			std::string lines[2][DESC_COUNT];
+
+			EncodedStatusLines(){
+				for(std::size_t i = 0; i < DESC_COUNT; ++i){
+					char temp[16];
+					for(unsigned minor = 0; minor < 2; ++minor){
+						const int len = std::sprintf(temp, "HTTP/1.%u %u ", minor, DESC_TABLE[i].status_code);
+						AUTO_REF(line, lines[minor][i]);
+						line.assign(temp, static_cast<std::size_t>(len));
+						line += DESC_TABLE[i].desc_short;
+						line += "\r\n";
+					}
+				}
+			}
+		} g_encoded_status_lines;
 	}
 
 	StatusCodeDesc get_status_code_desc(StatusCode status_code){
@@ -163,6 +183,21 @@ namespace Http {
 		}
 		return ret;
 	}
+
+	const std::string *get_encoded_status_line(unsigned version, StatusCode status_code, const std::string &reason){
+		if((version != 10000) && (version != 10001)){
+			return NULLPTR;
+		}
+		const AUTO(p, std::lower_bound(
+			BEGIN(DESC_TABLE), END(DESC_TABLE), status_code, DescElementComparator()));
+		if((p == END(DESC_TABLE)) || (p->status_code != status_code)){
+			return NULLPTR;
+		}
+		if(std::strcmp(reason.c_str(), p->desc_short) != 0){
+			return NULLPTR;
+		}
+		return &(g_encoded_status_lines.lines[version - 10000][static_cast<std::size_t>(p - BEGIN(DESC_TABLE))]);
+	}
 }
 
 }
@@ -4,6 +4,8 @@
 #ifndef POSEIDON_HTTP_STATUS_CODES_HPP_
 #define POSEIDON_HTTP_STATUS_CODES_HPP_
 
+#include <string>
+
 namespace Poseidon {
 
 namespace Http {
@@ -62,6 +64,10 @@ namespace Http {
 	};
 
 	extern StatusCodeDesc get_status_code_desc(StatusCode status_code);
+
+	// 返回预先编码的状态行，例如 "HTTP/1.1 200 OK\r\n"。
+	// 只有 HTTP/1.0 或 HTTP/1.1、已知的状态码并且 reason 与 desc_short 相同时可用，否则返回空指针。
+	extern const std::string *get_encoded_status_line(unsigned version, StatusCode status_code, const std::string &reason);
 }
 
 }
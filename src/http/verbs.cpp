@@ -38,6 +38,17 @@ namespace Http {
 		}
 		return static_cast<Verb>(i);
 	}
+	Verb get_verb_from_string(const char *str, std::size_t len){
+		if((len == 0) || (len >= sizeof(VERB_TABLE[0]))){
+			return V_INVALID_VERB;
+		}
+		for(unsigned i = 1; i < COUNT_OF(VERB_TABLE); ++i){
+			if((::memcmp(VERB_TABLE[i], str, len) == 0) && (VERB_TABLE[i][len] == 0)){
+				return static_cast<Verb>(i);
+			}
+		}
+		return V_INVALID_VERB;
+	}
 	const char *get_string_from_verb(Verb verb){
 		unsigned i = static_cast<unsigned>(verb);
 		if(i >= COUNT_OF(VERB_TABLE)){
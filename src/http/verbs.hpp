@@ -4,6 +4,8 @@
 #ifndef POSEIDON_HTTP_VERBS_HPP_
 #define POSEIDON_HTTP_VERBS_HPP_
 
+#include <cstddef>
+
 namespace Poseidon {
 
 namespace Http {
@@ -26,6 +28,7 @@ namespace Http {
 	using namespace Verbs;
 
 	extern Verb get_verb_from_string(const char *str);
+	extern Verb get_verb_from_string(const char *str, std::size_t len);
 	extern const char *get_string_from_verb(Verb verb);
 }
 
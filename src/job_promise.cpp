@@ -6,6 +6,7 @@
 #include "exception.hpp"
 #include "log.hpp"
 #include "atomic.hpp"
+#include "singletons/job_dispatcher.hpp"
 
 namespace Poseidon {
 
@@ -71,6 +72,8 @@ void JobPromise::set_success(){
 	}
 	m_except = boost::exception_ptr();
 	unlock(S_SATISFIED);
+
+	JobDispatcher::wake_fibers_for_promise(this);
 }
 void JobPromise::set_exception(const boost::exception_ptr &except){
 	assert(except);
@@ -82,6 +85,8 @@ void JobPromise::set_exception(const boost::exception_ptr &except){
 	}
 	m_except = except;
 	unlock(S_SATISFIED);
+
+	JobDispatcher::wake_fibers_for_promise(this);
 }
 
 }
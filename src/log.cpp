@@ -5,9 +5,11 @@
 #include "log.hpp"
 #include <unistd.h>
 #include <pthread.h>
+#include <new>
 #include "atomic.hpp"
 #include "time.hpp"
 #include "flags.hpp"
+#include "singletons/log_daemon.hpp"
 
 namespace Poseidon {
 
@@ -40,6 +42,11 @@ namespace {
 	}
 
 	__thread char t_tag[5] = "----";
+
+	// 同一毫秒内的日志共用格式化好的时间。
+	__thread boost::uint64_t t_time_cached = 0;
+	__thread char t_time_str[32];
+	__thread std::size_t t_time_len = 0;
 }
 
 boost::uint64_t Logger::get_mask() NOEXCEPT {
@@ -72,98 +79,343 @@ void Logger::set_thread_tag(const char *new_tag) NOEXCEPT {
 	}
 }
 
+class Logger::Buffer : NONCOPYABLE, public std::streambuf {
+private:
+	enum {
+		INITIAL_CAPACITY        = 256,
+		// 偶尔输出一行很长的日志，不要一直占着内存。
+		MAX_RETAINED_CAPACITY   = 65536,
+	};
+
+	static __thread Buffer *s_current;
+
+	static ::pthread_key_t s_key;
+	static ::pthread_once_t s_key_once;
+
+	static void key_destructor(void *ptr) NOEXCEPT {
+		s_current = NULLPTR;
+		delete static_cast<Buffer *>(ptr);
+	}
+	static void create_key() NOEXCEPT {
+		if(::pthread_key_create(&s_key, &key_destructor) != 0){
+			std::abort();
+		}
+	}
+
+public:
+	static Buffer *get_current() NOEXCEPT {
+		AUTO(buffer, s_current);
+		if(buffer){
+			return buffer;
+		}
+		::pthread_once(&s_key_once, &create_key);
+		buffer = new(std::nothrow) Buffer;
+		if(!buffer){
+			return NULLPTR;
+		}
+		if(::pthread_setspecific(s_key, buffer) != 0){
+			delete buffer;
+			return NULLPTR;
+		}
+		s_current = buffer;
+		return buffer;
+	}
+
+public:
+	bool busy;
+
+private:
+	char *m_data;
+	std::size_t m_capacity;
+
+	// 只在输出其他类型时才构造。
+	std::ostream *m_stream;
+	bool m_stream_used;
+	std::size_t m_stream_begin;
+
+public:
+	Buffer()
+		: busy(false)
+		, m_data(NULLPTR), m_capacity(0)
+		, m_stream(NULLPTR), m_stream_used(false), m_stream_begin(0)
+	{
+	}
+	~Buffer(){
+		delete m_stream;
+		std::free(m_data);
+	}
+
+private:
+	void grow(std::size_t min_avail){
+		const AUTO(size, get_size());
+		AUTO(capacity, std::max<std::size_t>(m_capacity, INITIAL_CAPACITY));
+		while(capacity - size < min_avail){
+			capacity *= 2;
+		}
+		const AUTO(data, static_cast<char *>(std::realloc(m_data, capacity)));
+		if(!data){
+			throw std::bad_alloc();
+		}
+		m_data = data;
+		m_capacity = capacity;
+		setp(data, data + capacity);
+		pbump(static_cast<int>(size));
+	}
+
+protected:
+	int_type overflow(int_type ch) OVERRIDE {
+		if(traits_type::eq_int_type(ch, traits_type::eof())){
+			return traits_type::not_eof(ch);
+		}
+		append(traits_type::to_char_type(ch));
+		return ch;
+	}
+	std::streamsize xsputn(const char *str, std::streamsize len) OVERRIDE {
+		append(str, static_cast<std::size_t>(len));
+		return len;
+	}
+
+public:
+	const char *get_data() const NOEXCEPT {
+		return pbase();
+	}
+	std::size_t get_size() const NOEXCEPT {
+		return static_cast<std::size_t>(pptr() - pbase());
+	}
+
+	char *reserve(std::size_t len){
+		if(static_cast<std::size_t>(epptr() - pptr()) < len){
+			grow(len);
+		}
+		return pptr();
+	}
+	void commit(std::size_t len) NOEXCEPT {
+		pbump(static_cast<int>(len));
+	}
+
+	void append(char ch){
+		*reserve(1) = ch;
+		commit(1);
+	}
+	void append(const char *str, std::size_t len){
+		std::memcpy(reserve(len), str, len);
+		commit(len);
+	}
+	void append(const char *str){
+		append(str, std::strlen(str));
+	}
+	// 正文中的控制字符替换成空格，保证每条日志只有一行。
+	void append_text(const char *str, std::size_t len){
+		const AUTO(write, reserve(len));
+		for(std::size_t i = 0; i < len; ++i){
+			char ch = str[i];
+			if(((unsigned char)ch + 1 <= 0x20) || (ch == 0x7F)){
+				ch = ' ';
+			}
+			write[i] = ch;
+		}
+		commit(len);
+	}
+	void append_decimal(unsigned long long val, bool negative){
+		char temp[24];
+		AUTO(read, temp + sizeof(temp));
+		do {
+			*--read = static_cast<char>('0' + val % 10);
+			val /= 10;
+		} while(val != 0);
+		if(negative){
+			*--read = '-';
+		}
+		append(read, static_cast<std::size_t>(temp + sizeof(temp) - read));
+	}
+	template<typename T>
+	void append_signed(T val){
+		if(val < 0){
+			append_decimal(-static_cast<unsigned long long>(val), true);
+		} else {
+			append_decimal(static_cast<unsigned long long>(val), false);
+		}
+	}
+	void append_hex(unsigned long long val, unsigned min_digits, bool upper_case){
+		static const char s_digits[2][16] = {
+			{ '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' },
+			{ '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' },
+		};
+		char temp[16];
+		AUTO(read, temp + sizeof(temp));
+		do {
+			*--read = s_digits[upper_case][val & 0x0F];
+			val >>= 4;
+		} while((val != 0) || (temp + sizeof(temp) - read < (std::ptrdiff_t)min_digits));
+		append(read, static_cast<std::size_t>(temp + sizeof(temp) - read));
+	}
+
+	// 流的格式标志没有被修改过时可以直接格式化，结果和 operator<< 相同。
+	bool is_stream_plain() const NOEXCEPT {
+		return !m_stream_used || (m_stream->width() == 0);
+	}
+	bool is_stream_plain_integer() const NOEXCEPT {
+		return !m_stream_used || ((m_stream->width() == 0) &&
+			((m_stream->flags() & (std::ios_base::basefield | std::ios_base::showpos)) == std::ios_base::dec));
+	}
+	bool is_stream_plain_float() const NOEXCEPT {
+		return !m_stream_used || ((m_stream->width() == 0) && (m_stream->precision() == 6) &&
+			((m_stream->flags() & (std::ios_base::floatfield | std::ios_base::showpos |
+				std::ios_base::showpoint | std::ios_base::uppercase)) == 0));
+	}
+
+	std::ostream &begin_stream_put(){
+		if(!m_stream){
+			m_stream = new std::ostream(this);
+		}
+		m_stream_used = true;
+		m_stream_begin = get_size();
+		return *m_stream;
+	}
+	void end_stream_put() NOEXCEPT {
+		const AUTO(end, get_size());
+		for(AUTO(i, m_stream_begin); i < end; ++i){
+			char &ch = pbase()[i];
+			if(((unsigned char)ch + 1 <= 0x20) || (ch == 0x7F)){
+				ch = ' ';
+			}
+		}
+	}
+
+	void clear() NOEXCEPT {
+		if(m_capacity > MAX_RETAINED_CAPACITY){
+			std::free(m_data);
+			m_data = NULLPTR;
+			m_capacity = 0;
+		}
+		setp(m_data, m_data + m_capacity);
+		if(m_stream_used){
+			m_stream->flags(std::ios_base::skipws | std::ios_base::dec);
+			m_stream->width(0);
+			m_stream->precision(6);
+			m_stream->fill(' ');
+			m_stream->clear();
+			m_stream_used = false;
+		}
+		busy = false;
+	}
+};
+
+__thread Logger::Buffer *Logger::Buffer::s_current = 0;
+
+::pthread_key_t Logger::Buffer::s_key;
+::pthread_once_t Logger::Buffer::s_key_once = PTHREAD_ONCE_INIT;
+
 Logger::Logger(boost::uint64_t mask, const char *file, std::size_t line) NOEXCEPT
 	: m_mask(mask), m_file(file), m_line(line)
+	, m_buffer(NULLPTR), m_buffer_owned(false), m_use_ascii_colors(false)
 {
-}
-Logger::~Logger() NOEXCEPT {
 	static const bool stderr_uses_ascii_colors = ::isatty(STDERR_FILENO);
 	static const bool stdout_uses_ascii_colors = ::isatty(STDOUT_FILENO);
 
-	try {
-		bool use_ascii_colors;
-		int fd;
-		if(m_mask & SP_MAJOR){
-			use_ascii_colors = stderr_uses_ascii_colors;
-			fd = STDERR_FILENO;
-		} else {
-			use_ascii_colors = stdout_uses_ascii_colors;
-			fd = STDOUT_FILENO;
-		}
+	m_use_ascii_colors = (m_mask & SP_MAJOR) ? stderr_uses_ascii_colors : stdout_uses_ascii_colors;
 
-		AUTO_REF(level_elem, LEVEL_ELEMENTS[__builtin_ctz(m_mask | LV_TRACE)]);
-
-		char temp[256];
-		unsigned len;
+	AUTO(buffer, Buffer::get_current());
+	if(!buffer || buffer->busy){
+		// 在格式化参数的过程中又输出了日志，这种情况很少见。
+		buffer = new(std::nothrow) Buffer;
+		if(!buffer){
+			return;
+		}
+		m_buffer_owned = true;
+	}
+	buffer->busy = true;
+	m_buffer = buffer;
 
-		std::string line;
-		line.reserve(255);
+	try {
+		const unsigned level = static_cast<unsigned>(__builtin_ctz(m_mask | LV_TRACE));
+		AUTO_REF(level_elem, LEVEL_ELEMENTS[level]);
 
-		if(use_ascii_colors){
-			line += "\x1B[0;32m";
+		if(m_use_ascii_colors){
+			buffer->append("\x1B[0;32m");
 		}
-		len = format_time(temp, sizeof(temp), get_local_time(), true);
-		line.append(temp, len);
+		const AUTO(now, get_local_time());
+		if((t_time_len == 0) || (t_time_cached != now)){
+			t_time_len = format_time(t_time_str, sizeof(t_time_str), now, true);
+			t_time_cached = now;
+		}
+		buffer->append(t_time_str, t_time_len);
 
-		if(use_ascii_colors){
-			line += "\x1B[0;33m";
+		if(m_use_ascii_colors){
+			buffer->append("\x1B[0;33m");
 		}
-		len = (unsigned)std::sprintf(temp, " %02X ", (unsigned)((m_mask >> 8) & 0xFF));
-		line.append(temp, len);
+		buffer->append(' ');
+		buffer->append_hex((m_mask >> 8) & 0xFF, 2, true);
+		buffer->append(' ');
 
-		if(use_ascii_colors){
-			line += "\x1B[0;39m";
+		if(m_use_ascii_colors){
+			buffer->append("\x1B[0;39m");
 		}
-		line += '[';
-		line.append(t_tag, sizeof(t_tag) - 1);
-		line += ']';
-		line += ' ';
+		buffer->append('[');
+		buffer->append(t_tag, sizeof(t_tag) - 1);
+		buffer->append(']');
+		buffer->append(' ');
 
-		if(use_ascii_colors){
-			line +="\x1B[0;30;4";
-			line += level_elem.color;
-			line += 'm';
+		if(m_use_ascii_colors){
+			const char seq[] = { '\x1B', '[', '0', ';', '3', '0', ';', '4', level_elem.color, 'm' };
+			buffer->append(seq, sizeof(seq));
 		}
-		line += level_elem.text;
-		if(use_ascii_colors){
-			line +="\x1B[0;40;3";
-			line += level_elem.color;
+		buffer->append(level_elem.text);
+		if(m_use_ascii_colors){
+			const char seq[] = { '\x1B', '[', '0', ';', '4', '0', ';', '3', level_elem.color };
+			buffer->append(seq, sizeof(seq));
 			if(level_elem.highlighted){
-				line += ';';
-				line += '1';
+				buffer->append(";1", 2);
 			}
-			line += 'm';
+			buffer->append('m');
 		}
-		line += ' ';
+		buffer->append(' ');
+	} catch(...){
+	}
+}
+Logger::~Logger() NOEXCEPT {
+	const AUTO(buffer, m_buffer);
+	if(!buffer){
+		return;
+	}
 
-		char ch;
-		while(m_stream.get(ch)){
-			if(((unsigned char)ch + 1 <= 0x20) || (ch == 0x7F)){
-				ch = ' ';
-			}
-			line.push_back(ch);
+	try {
+		int fd;
+		if(m_mask & SP_MAJOR){
+			fd = STDERR_FILENO;
+		} else {
+			fd = STDOUT_FILENO;
 		}
-		line += ' ';
+		const unsigned level = static_cast<unsigned>(__builtin_ctz(m_mask | LV_TRACE));
 
-		if(use_ascii_colors){
-			line += "\x1B[0;34m";
+		buffer->append(' ');
+
+		if(m_use_ascii_colors){
+			buffer->append("\x1B[0;34m");
 		}
-		line += '#';
-		line += m_file;
-		len = (unsigned)std::sprintf(temp, ":%lu", (unsigned long)m_line);
-		line.append(temp, len);
+		buffer->append('#');
+		buffer->append(m_file);
+		buffer->append(':');
+		buffer->append_decimal(m_line, false);
 
-		if(use_ascii_colors){
-			line += "\x1B[0m";
+		if(m_use_ascii_colors){
+			buffer->append("\x1B[0m");
 		}
-		line += '\n';
+		buffer->append('\n');
+
+		const AUTO(data, buffer->get_data());
+		const AUTO(size, buffer->get_size());
 
-		{
+		// 致命错误之后进程很可能马上退出，先写出缓冲区中之前的日志，再同步写入。
+		if(level == 0){
+			LogDaemon::flush();
+		}
+		if((level == 0) || !LogDaemon::enqueue(fd, data, size)){
 			::pthread_mutex_lock(&g_mutex);
 
 			std::size_t bytes_total = 0;
-			while(bytes_total < line.size()){
-				const AUTO(bytes_written, ::write(fd, line.data() + bytes_total, line.size() - bytes_total)); // noexcept
+			while(bytes_total < size){
+				const AUTO(bytes_written, ::write(fd, data + bytes_total, size - bytes_total)); // noexcept
 				if(bytes_written <= 0){
 					break;
 				}
@@ -174,55 +426,159 @@ Logger::~Logger() NOEXCEPT {
 		}
 	} catch(...){
 	}
+
+	if(m_buffer_owned){
+		delete buffer;
+	} else {
+		buffer->clear();
+	}
+}
+
+std::ostream &Logger::begin_stream_put(){
+	return m_buffer->begin_stream_put();
+}
+void Logger::end_stream_put() NOEXCEPT {
+	m_buffer->end_stream_put();
 }
 
 void Logger::put(bool val){
-	m_stream <<std::boolalpha <<val;
+	if(!m_buffer->is_stream_plain()){
+		begin_stream_put() <<std::boolalpha <<val;
+		end_stream_put();
+		return;
+	}
+	if(val){
+		m_buffer->append("true", 4);
+	} else {
+		m_buffer->append("false", 5);
+	}
 }
 void Logger::put(char val){
-	m_stream <<val;
+	if(!m_buffer->is_stream_plain()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	m_buffer->append_text(&val, 1);
 }
 void Logger::put(signed char val){
-	m_stream <<static_cast<int>(val);
+	put(static_cast<int>(val));
 }
 void Logger::put(unsigned char val){
-	m_stream <<static_cast<unsigned>(val);
+	put(static_cast<unsigned>(val));
 }
 void Logger::put(short val){
-	m_stream <<static_cast<int>(val);
+	put(static_cast<int>(val));
 }
 void Logger::put(unsigned short val){
-	m_stream <<static_cast<unsigned>(val);
+	put(static_cast<unsigned>(val));
 }
 void Logger::put(int val){
-	m_stream <<val;
+	if(!m_buffer->is_stream_plain_integer()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	m_buffer->append_signed(val);
 }
 void Logger::put(unsigned val){
-	m_stream <<val;
+	if(!m_buffer->is_stream_plain_integer()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	m_buffer->append_decimal(val, false);
 }
 void Logger::put(long val){
-	m_stream <<val;
+	if(!m_buffer->is_stream_plain_integer()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	m_buffer->append_signed(val);
 }
 void Logger::put(unsigned long val){
-	m_stream <<val;
+	if(!m_buffer->is_stream_plain_integer()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	m_buffer->append_decimal(val, false);
 }
 void Logger::put(long long val){
-	m_stream <<val;
+	if(!m_buffer->is_stream_plain_integer()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	m_buffer->append_signed(val);
 }
 void Logger::put(unsigned long long val){
-	m_stream <<val;
+	if(!m_buffer->is_stream_plain_integer()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	m_buffer->append_decimal(val, false);
 }
 void Logger::put(const char *val){
-	m_stream <<val;
+	if(!m_buffer->is_stream_plain() || !val){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	m_buffer->append_text(val, std::strlen(val));
 }
 void Logger::put(const signed char *val){
-	m_stream <<static_cast<const void *>(val);
+	put(static_cast<const void *>(val));
 }
 void Logger::put(const unsigned char *val){
-	m_stream <<static_cast<const void *>(val);
+	put(static_cast<const void *>(val));
 }
 void Logger::put(const void *val){
-	m_stream <<val;
+	if(!m_buffer->is_stream_plain()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	if(!val){
+		m_buffer->append('0');
+		return;
+	}
+	m_buffer->append("0x", 2);
+	m_buffer->append_hex(reinterpret_cast<std::size_t>(val), 1, false);
+}
+void Logger::put(float val){
+	put(static_cast<double>(val));
+}
+void Logger::put(double val){
+	if(!m_buffer->is_stream_plain_float()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	// 和 std::ostream 默认的格式相同。
+	char temp[64];
+	const int len = std::snprintf(temp, sizeof(temp), "%.6g", val);
+	m_buffer->append(temp, static_cast<std::size_t>(len));
+}
+void Logger::put(long double val){
+	if(!m_buffer->is_stream_plain_float()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	char temp[64];
+	const int len = std::snprintf(temp, sizeof(temp), "%.6Lg", val);
+	m_buffer->append(temp, static_cast<std::size_t>(len));
+}
+void Logger::put(const std::string &val){
+	if(!m_buffer->is_stream_plain()){
+		begin_stream_put() <<val;
+		end_stream_put();
+		return;
+	}
+	m_buffer->append_text(val.data(), val.size());
 }
 
 }
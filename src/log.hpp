@@ -6,7 +6,8 @@
 
 #include "cxx_ver.hpp"
 #include "cxx_util.hpp"
-#include <sstream>
+#include <ostream>
+#include <string>
 #include <cstddef>
 #include <boost/cstdint.hpp>
 
@@ -33,12 +34,18 @@ public:
 	static const char *get_thread_tag() NOEXCEPT;
 	static void set_thread_tag(const char *new_tag) NOEXCEPT;
 
+private:
+	class Buffer;
+
 private:
 	const boost::uint64_t m_mask;
 	const char *const m_file;
 	const std::size_t m_line;
 
-	std::stringstream m_stream;
+	// 通常指向当前线程的缓冲区，不分配内存。
+	Buffer *m_buffer;
+	bool m_buffer_owned;
+	bool m_use_ascii_colors;
 
 public:
 	Logger(boost::uint64_t mask, const char *file, std::size_t line) NOEXCEPT;
@@ -62,15 +69,28 @@ private:
 	void put(const signed char *val);
 	void put(const unsigned char *val);
 	void put(const void *val);
+	void put(float val);
+	void put(double val);
+	void put(long double val);
+	void put(const std::string &val);
+
+	// 其他类型仍然使用 operator<<，但是直接写入同一个缓冲区。
+	std::ostream &begin_stream_put();
+	void end_stream_put() NOEXCEPT;
 
 	template<typename T>
 	void put(const T &val){
-		m_stream <<val;
+		std::ostream &os = begin_stream_put();
+		os <<val;
+		end_stream_put();
 	}
 
 public:
 	template<typename T>
 	Logger &operator,(const T &val) NOEXCEPT {
+		if(!m_buffer){
+			return *this;
+		}
 		try {
 			this->put(val);
 		} catch(...){
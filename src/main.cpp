@@ -7,6 +7,7 @@
 #include "time.hpp"
 #include "exception.hpp"
 #include "singletons/main_config.hpp"
+#include "singletons/log_daemon.hpp"
 #include "singletons/dns_daemon.hpp"
 #include "singletons/timer_daemon.hpp"
 #include "singletons/mysql_daemon.hpp"
@@ -150,6 +151,7 @@ int main(int argc, char **argv){
 		MainConfig::set_run_path((1 < argc) ? argv[1] : "/usr/etc/poseidon");
 		MainConfig::reload();
 
+		START(LogDaemon);
 		START(ProfileDepository);
 
 		run();
@@ -6,6 +6,30 @@
 
 namespace Poseidon {
 
+OptionalMap::iterator OptionalMap::insert_at(iterator pos, SharedNts &key, std::string &val){
+	if(m_delegator.capacity() == 0){
+		const AUTO(offset, pos - m_delegator.begin());
+		m_delegator.reserve(INITIAL_CAPACITY);
+		pos = m_delegator.begin() + offset;
+	}
+#ifdef POSEIDON_CXX11
+	return m_delegator.emplace(pos, std::move(key), std::move(val));
+#else
+	// 先插入一个空元素再交换进去，避免复制字符串。
+	pos = m_delegator.insert(pos, value_type());
+	pos->first.swap(key);
+	pos->second.swap(val);
+	return pos;
+#endif
+}
+
+std::size_t OptionalMap::erase(const char *key){
+	const AUTO(pair, range(key));
+	const AUTO(count, static_cast<std::size_t>(pair.second - pair.first));
+	m_delegator.erase(pair.first, pair.second);
+	return count;
+}
+
 const std::string &OptionalMap::get(const char *key) const {
 	const const_iterator it = find(key);
 	if(it == end()){
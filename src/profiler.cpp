@@ -4,7 +4,6 @@
 #include "precompiled.hpp"
 #include "profiler.hpp"
 #include "singletons/profile_depository.hpp"
-#include "time.hpp"
 #include "log.hpp"
 
 namespace Poseidon {
@@ -18,9 +17,10 @@ void Profiler::accumulate_all_in_thread() NOEXCEPT {
 		return;
 	}
 
-	const AUTO(now, get_hi_res_mono_clock());
+	bool now_tsc;
+	const AUTO(now, ProfileDepository::get_ticks(now_tsc));
 	for(AUTO(cur, t_top_profiler); cur; cur = cur->m_prev){
-		cur->accumulate(now);
+		cur->accumulate(now, now_tsc);
 	}
 }
 
@@ -31,8 +31,9 @@ void *Profiler::begin_stack_switch() NOEXCEPT {
 
 	const AUTO(top, t_top_profiler);
 	if(top){
-		const AUTO(now, get_hi_res_mono_clock());
-		top->accumulate(now);
+		bool now_tsc;
+		const AUTO(now, ProfileDepository::get_ticks(now_tsc));
+		top->accumulate(now, now_tsc);
 		top->m_yielded_since = now;
 	}
 	t_top_profiler = NULLPTR;
@@ -45,23 +46,30 @@ void Profiler::end_stack_switch(void *opaque) NOEXCEPT {
 
 	const AUTO(top, static_cast<Profiler *>(opaque));
 	if(top){
-		const AUTO(now, get_hi_res_mono_clock());
+		bool now_tsc;
+		const AUTO(now, ProfileDepository::get_ticks(now_tsc));
+		// 如果计时方式在让出期间改变，accumulate() 会丢弃这个区间，m_excluded 也一并清零。
 		top->m_excluded += now - top->m_yielded_since;
-		top->accumulate(now);
+		top->accumulate(now, now_tsc);
 	}
 	t_top_profiler = top;
 }
 
-Profiler::Profiler(const char *file, unsigned long line, const char *func) NOEXCEPT
-	: m_prev(t_top_profiler), m_file(file), m_line(line), m_func(func)
-	, m_start(0), m_excluded(0), m_yielded_since(0)
+Profiler::Profiler(CallSite &site) NOEXCEPT
+	: m_prev(t_top_profiler), m_site(site)
+	, m_begin(0), m_start(0), m_excluded(0), m_yielded_since(0)
+	, m_begin_tsc(false), m_start_tsc(false)
 {
 	if(!ProfileDepository::is_enabled()){
 		return;
 	}
 
-	const AUTO(now, get_hi_res_mono_clock());
+	bool now_tsc;
+	const AUTO(now, ProfileDepository::get_ticks(now_tsc));
+	m_begin = now;
 	m_start = now;
+	m_begin_tsc = now_tsc;
+	m_start_tsc = now_tsc;
 
 	t_top_profiler = this;
 }
@@ -72,26 +80,33 @@ Profiler::~Profiler() NOEXCEPT {
 
 	t_top_profiler = m_prev;
 
-	const AUTO(now, get_hi_res_mono_clock());
-	accumulate(now);
+	bool now_tsc;
+	const AUTO(now, ProfileDepository::get_ticks(now_tsc));
+	accumulate(now, now_tsc);
+	// 计时方式在 ProfileDepository::start() 中可能改变，跨越这个时刻的区间作废。
+	if(m_begin_tsc == now_tsc){
+		ProfileDepository::record_latency(m_site, now - m_begin);
+	}
 
 	if(std::uncaught_exception()){
 		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
-			"Exception backtrace: file = ", m_file, ", line = ", m_line, ", func = ", m_func);
+			"Exception backtrace: file = ", m_site.file, ", line = ", m_site.line, ", func = ", m_site.func);
 	}
 }
 
-void Profiler::accumulate(double now) NOEXCEPT {
-	const AUTO(total, now - m_start);
-	const AUTO(exclusive, total - m_excluded);
+void Profiler::accumulate(boost::uint64_t now, bool now_tsc) NOEXCEPT {
+	// 计时方式在 ProfileDepository::start() 中可能改变，跨越这个时刻的区间作废。
+	const AUTO(total, (m_start_tsc == now_tsc) ? (now - m_start) : 0);
+	const AUTO(exclusive, (total >= m_excluded) ? (total - m_excluded) : 0);
 	m_start = now;
+	m_start_tsc = now_tsc;
 	m_excluded = 0;
 
 	if(m_prev){
 		m_prev->m_excluded += total;
 	}
 
-	ProfileDepository::accumulate(m_file, m_line, m_func, total, exclusive);
+	ProfileDepository::accumulate(m_site, total, exclusive);
 }
 
 }
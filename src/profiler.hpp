@@ -6,10 +6,21 @@
 
 #include "cxx_ver.hpp"
 #include "cxx_util.hpp"
+#include <cstddef>
+#include <boost/cstdint.hpp>
 
 namespace Poseidon {
 
 class Profiler : NONCOPYABLE {
+public:
+	// 每个 PROFILE_ME 对应一个静态对象，index 在第一次累加时由 ProfileDepository 分配。
+	struct CallSite {
+		const char *file;
+		unsigned long line;
+		const char *func;
+		volatile std::size_t index;
+	};
+
 public:
 	static void accumulate_all_in_thread() NOEXCEPT;
 
@@ -18,25 +29,31 @@ public:
 
 private:
 	Profiler *const m_prev;
-	const char *const m_file;
-	const unsigned long m_line;
-	const char *const m_func;
+	CallSite &m_site;
 
-	double m_start;
-	double m_excluded;
-	double m_yielded_since;
+	boost::uint64_t m_begin;
+	boost::uint64_t m_start;
+	boost::uint64_t m_excluded;
+	boost::uint64_t m_yielded_since;
+	// 读取 m_begin 和 m_start 时是否使用 TSC。
+	bool m_begin_tsc;
+	bool m_start_tsc;
 
 public:
-	Profiler(const char *file, unsigned long line, const char *func) NOEXCEPT;
+	explicit Profiler(CallSite &site) NOEXCEPT;
 	~Profiler() NOEXCEPT;
 
 private:
-	void accumulate(double now) NOEXCEPT;
+	void accumulate(boost::uint64_t now, bool now_tsc) NOEXCEPT;
 };
 
 }
 
+#define PROFILE_ME_(site_)	\
+	static ::Poseidon::Profiler::CallSite site_ = { __FILE__, __LINE__, __PRETTY_FUNCTION__, 0 };	\
+	const ::Poseidon::Profiler TOKEN_CAT2(site_, profiler_)(site_)
+
 #define PROFILE_ME	\
-	const ::Poseidon::Profiler UNIQUE_ID(__FILE__, __LINE__, __PRETTY_FUNCTION__)
+	PROFILE_ME_(UNIQUE_ID)
 
 #endif
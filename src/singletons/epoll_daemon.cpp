@@ -8,6 +8,7 @@
 #include "../thread.hpp"
 #include "../epoll.hpp"
 #include "../log.hpp"
+#include "../exception.hpp"
 #include "../atomic.hpp"
 #include "../time.hpp"
 #include "../tcp_session_base.hpp"
@@ -19,11 +20,9 @@ namespace Poseidon {
 namespace {
 	std::size_t g_max_timeout               = 100;
 	boost::uint64_t g_tcp_request_timeout   = 30000;
+	std::size_t g_thread_count              = 1;
 
 	volatile bool g_running = false;
-	Thread g_thread;
-
-	boost::shared_ptr<Epoll> g_epoll = boost::make_shared<Epoll>();
 
 	Mutex g_server_mutex;
 	std::vector<boost::weak_ptr<const SocketServerBase> > g_servers;
@@ -62,58 +61,96 @@ namespace {
 		return count;
 	}
 
-	void daemon_loop(){
-		PROFILE_ME;
+	class EpollThread : NONCOPYABLE {
+	private:
+		// 只有第一个线程负责接受新连接，新连接通过 EpollDaemon::add_session() 分配到各个线程。
+		const bool m_accepts_connections;
+		const boost::shared_ptr<Epoll> m_epoll;
 
-		boost::uint64_t epoll_timeout = 0;
-		for(;;){
-			bool busy = false;
+		Thread m_thread;
 
-			try {
-				if(JobDispatcher::is_running()){
-					if(poll_servers() > 0){
-						++busy;
+	public:
+		explicit EpollThread(bool accepts_connections)
+			: m_accepts_connections(accepts_connections), m_epoll(boost::make_shared<Epoll>())
+		{
+		}
+
+	private:
+		void daemon_loop(){
+			PROFILE_ME;
+
+			boost::uint64_t epoll_timeout = 0;
+			for(;;){
+				bool busy = false;
+
+				try {
+					if(JobDispatcher::is_running()){
+						if(m_accepts_connections && (poll_servers() > 0)){
+							busy = true;
+						}
+						if(m_epoll->pump_readable() > 0){
+							busy = true;
+						}
 					}
-					if(g_epoll->pump_readable() > 0){
-						++busy;
+					if(m_epoll->pump_writeable() > 0){
+						busy = true;
 					}
-				}
-				if(g_epoll->pump_writeable() > 0){
-					++busy;
-				}
-				if(g_epoll->wait(epoll_timeout) > 0){
-					++busy;
-				}
-				// 二次指数回退算法。如果有连接接入（忙），epoll 等待时间就短一些；反之（闲）亦然。
-				if(busy){
-					epoll_timeout = 0;
-				} else {
-					epoll_timeout |= 1;
-					epoll_timeout <<= 1;
-					if(epoll_timeout > g_max_timeout){
-						epoll_timeout = g_max_timeout;
+					if(m_epoll->pump_timeouts() > 0){
+						busy = true;
+					}
+					if(m_epoll->wait(epoll_timeout) > 0){
+						busy = true;
 					}
+					// 二次指数回退算法。如果有连接接入（忙），epoll 等待时间就短一些；反之（闲）亦然。
+					if(busy){
+						epoll_timeout = 0;
+					} else {
+						epoll_timeout |= 1;
+						epoll_timeout <<= 1;
+						if(epoll_timeout > g_max_timeout){
+							epoll_timeout = g_max_timeout;
+						}
+					}
+				} catch(std::exception &e){
+					LOG_POSEIDON_ERROR("std::exception thrown while flush data: what = ", e.what());
+				} catch(...){
+					LOG_POSEIDON_ERROR("Unknown exception thrown while flush data.");
 				}
-			} catch(std::exception &e){
-				LOG_POSEIDON_ERROR("std::exception thrown while flush data: what = ", e.what());
-			} catch(...){
-				LOG_POSEIDON_ERROR("Unknown exception thrown while flush data.");
-			}
 
-			if(!busy && !atomic_load(g_running, ATOMIC_CONSUME)){
-				break;
+				if(!busy && !atomic_load(g_running, ATOMIC_CONSUME)){
+					break;
+				}
 			}
 		}
-	}
 
-	void thread_proc(){
-		PROFILE_ME;
-		LOG_POSEIDON_INFO("Epoll daemon started.");
+		void thread_proc(){
+			PROFILE_ME;
+			LOG_POSEIDON_INFO("Epoll thread started.");
 
-		daemon_loop();
+			daemon_loop();
 
-		LOG_POSEIDON_INFO("Epoll daemon stopped.");
-	}
+			LOG_POSEIDON_INFO("Epoll thread stopped.");
+		}
+
+	public:
+		const boost::shared_ptr<Epoll> &get_epoll() const {
+			return m_epoll;
+		}
+
+		void start(){
+			Thread(boost::bind(&EpollThread::thread_proc, this), "   N").swap(m_thread);
+		}
+		void safe_join(){
+			if(m_thread.joinable()){
+				m_thread.join();
+			}
+		}
+	};
+
+	// EpollDaemon 停止时，其他线程（例如 JobDispatcher 中的任务）可能还在调用 add_session()，因此要加锁。
+	Mutex g_thread_mutex;
+	std::vector<boost::shared_ptr<EpollThread> > g_threads;
+	volatile std::size_t g_next_thread_index = 0;
 }
 
 void EpollDaemon::start(){
@@ -129,7 +166,24 @@ void EpollDaemon::start(){
 	MainConfig::get(g_tcp_request_timeout, "epoll_tcp_request_timeout");
 	LOG_POSEIDON_DEBUG("Tcp request timeout = ", g_tcp_request_timeout);
 
-	Thread(&thread_proc, "   N").swap(g_thread);
+	MainConfig::get(g_thread_count, "epoll_thread_count");
+	LOG_POSEIDON_DEBUG("Thread count = ", g_thread_count);
+	if(g_thread_count == 0){
+		g_thread_count = 1;
+	}
+
+	std::vector<boost::shared_ptr<EpollThread> > threads;
+	threads.reserve(g_thread_count);
+	for(std::size_t i = 0; i < g_thread_count; ++i){
+		threads.push_back(boost::make_shared<EpollThread>(i == 0));
+	}
+	for(AUTO(it, threads.begin()); it != threads.end(); ++it){
+		(*it)->start();
+	}
+
+	const Mutex::UniqueLock lock(g_thread_mutex);
+	g_threads.swap(threads);
+	atomic_store(g_next_thread_index, 0, ATOMIC_RELAXED);
 }
 void EpollDaemon::stop(){
 	if(atomic_exchange(g_running, false, ATOMIC_ACQ_REL) == false){
@@ -137,10 +191,20 @@ void EpollDaemon::stop(){
 	}
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping epoll daemon...");
 
-	if(g_thread.joinable()){
-		g_thread.join();
+	// 取出之后 add_session() 不会再把新连接分配到这些线程中。
+	std::vector<boost::shared_ptr<EpollThread> > threads;
+	{
+		const Mutex::UniqueLock lock(g_thread_mutex);
+		threads.swap(g_threads);
+	}
+	for(AUTO(it, threads.begin()); it != threads.end(); ++it){
+		(*it)->safe_join();
 	}
-	g_epoll->clear();
+	for(AUTO(it, threads.begin()); it != threads.end(); ++it){
+		(*it)->get_epoll()->clear();
+	}
+
+	const Mutex::UniqueLock lock(g_server_mutex);
 	g_servers.clear();
 }
 
@@ -149,8 +213,15 @@ boost::uint64_t EpollDaemon::get_tcp_request_timeout(){
 }
 
 std::vector<EpollDaemon::SnapshotElement> EpollDaemon::snapshot(){
+	std::vector<boost::shared_ptr<EpollThread> > threads;
+	{
+		const Mutex::UniqueLock lock(g_thread_mutex);
+		threads = g_threads;
+	}
 	std::vector<boost::shared_ptr<TcpSessionBase> > sessions;
-	g_epoll->snapshot(sessions);
+	for(AUTO(it, threads.begin()); it != threads.end(); ++it){
+		(*it)->get_epoll()->snapshot(sessions);
+	}
 
 	std::vector<SnapshotElement> ret;
 	const AUTO(now, get_fast_mono_clock());
@@ -165,7 +236,15 @@ std::vector<EpollDaemon::SnapshotElement> EpollDaemon::snapshot(){
 }
 
 void EpollDaemon::add_session(const boost::shared_ptr<TcpSessionBase> &session){
-	g_epoll->add_session(session);
+	// 持有锁直到连接被加入，这样 stop() 取出线程之后就不会再有连接加入。
+	const Mutex::UniqueLock lock(g_thread_mutex);
+	if(g_threads.empty()){
+		LOG_POSEIDON_ERROR("Epoll daemon is not running.");
+		DEBUG_THROW(Exception, sslit("Epoll daemon is not running"));
+	}
+	// 新连接轮流分配到各个线程中。此后该连接上的所有 I/O 都在这个线程中完成。
+	const AUTO(index, atomic_add(g_next_thread_index, 1, ATOMIC_RELAXED) % g_threads.size());
+	g_threads.at(index)->get_epoll()->add_session(session);
 }
 void EpollDaemon::register_server(boost::weak_ptr<const SocketServerBase> server){
 	const Mutex::UniqueLock lock(g_server_mutex);
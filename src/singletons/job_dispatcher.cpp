@@ -4,10 +4,14 @@
 #include "../precompiled.hpp"
 #include "job_dispatcher.hpp"
 #include "main_config.hpp"
-#include <ucontext.h>
+#ifndef __x86_64__
+#	include <ucontext.h>
+#endif
 #include <sys/mman.h>
+#include <unistd.h>
 #include <errno.h>
-#include <boost/container/map.hpp>
+#include <boost/unordered_map.hpp>
+#include <map>
 #include <vector>
 #include "../job_base.hpp"
 #include "../job_promise.hpp"
@@ -17,12 +21,68 @@
 #include "../profiler.hpp"
 #include "../mutex.hpp"
 #include "../condition_variable.hpp"
+#include "../thread.hpp"
 #include "../time.hpp"
 
+#ifdef __x86_64__
+// swapcontext() 每次都会调用 rt_sigprocmask()，这里只保存被调用者保存的寄存器。
+// switch_stack 把当前的栈指针保存到 *save_sp，然后切换到 load_sp 并返回到那里保存的位置。
+// 新的栈第一次被切换进去时会返回到 stack_entry，它以 %r12 为参数调用 %r13 指向的函数，后者不能返回。
+extern "C" __attribute__((__visibility__("hidden"))) void poseidon_job_dispatcher_switch_stack(void **save_sp, void *load_sp);
+extern "C" __attribute__((__visibility__("hidden"))) void poseidon_job_dispatcher_stack_entry();
+
+__asm__(
+	".pushsection .text \n"
+	".globl poseidon_job_dispatcher_switch_stack \n"
+	".hidden poseidon_job_dispatcher_switch_stack \n"
+	".type poseidon_job_dispatcher_switch_stack, @function \n"
+	".p2align 4 \n"
+	"poseidon_job_dispatcher_switch_stack: \n"
+	"	pushq %rbp \n"
+	"	pushq %rbx \n"
+	"	pushq %r12 \n"
+	"	pushq %r13 \n"
+	"	pushq %r14 \n"
+	"	pushq %r15 \n"
+	"	subq $8, %rsp \n"
+	"	stmxcsr (%rsp) \n"
+	"	fnstcw 4(%rsp) \n"
+	"	movq %rsp, (%rdi) \n"
+	"	movq %rsi, %rsp \n"
+	"	ldmxcsr (%rsp) \n"
+	"	fldcw 4(%rsp) \n"
+	"	addq $8, %rsp \n"
+	"	popq %r15 \n"
+	"	popq %r14 \n"
+	"	popq %r13 \n"
+	"	popq %r12 \n"
+	"	popq %rbx \n"
+	"	popq %rbp \n"
+	"	ret \n"
+	".size poseidon_job_dispatcher_switch_stack, .-poseidon_job_dispatcher_switch_stack \n"
+	".globl poseidon_job_dispatcher_stack_entry \n"
+	".hidden poseidon_job_dispatcher_stack_entry \n"
+	".type poseidon_job_dispatcher_stack_entry, @function \n"
+	".p2align 4 \n"
+	"poseidon_job_dispatcher_stack_entry: \n"
+	"	movq %r12, %rdi \n"
+	"	callq *%r13 \n"
+	"	ud2 \n"
+	".size poseidon_job_dispatcher_stack_entry, .-poseidon_job_dispatcher_stack_entry \n"
+	".popsection \n"
+);
+#endif
+
 namespace Poseidon {
 
 namespace {
 	boost::uint64_t g_job_timeout = 60000;
+	std::size_t g_thread_count = 1;
+	std::size_t g_stack_size = 256 * 1024;
+	std::size_t g_stack_pool_size = 64;
+
+	// 主线程是零号工作线程。
+	const std::size_t NO_WORKER = (std::size_t)-1;
 
 	enum FiberState {
 		FS_READY,
@@ -45,85 +105,227 @@ namespace {
 		}
 	};
 
-	struct StackStorage FINAL {
-		static void *operator new(std::size_t cb){
-			assert(cb == sizeof(StackStorage));
-			(void)cb;
+	// 栈的最低处有一个保护页，溢出时会触发 SIGSEGV，而不是悄悄改写其他内存。
+	class StackStorage : NONCOPYABLE {
+	private:
+		std::size_t m_guard_size;
+		std::size_t m_mapped_size;
+		void *m_base;
 
-			const AUTO(ptr, mmap(NULLPTR, sizeof(StackStorage),
-				PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_GROWSDOWN | MAP_STACK, -1, 0));
-			if(ptr == MAP_FAILED){
+	public:
+		explicit StackStorage(std::size_t size){
+			m_guard_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+			m_mapped_size = m_guard_size + (size + m_guard_size - 1) / m_guard_size * m_guard_size;
+
+			m_base = ::mmap(NULLPTR, m_mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+			if(m_base == MAP_FAILED){
 				const int err_code = errno;
 				LOG_POSEIDON_ERROR("Failed to allocate stack: err_code = ", err_code);
 				throw std::bad_alloc();
 			}
-			return ptr;
+			if(::mprotect(m_base, m_guard_size, PROT_NONE) != 0){
+				const int err_code = errno;
+				LOG_POSEIDON_ERROR("Failed to protect stack guard page: err_code = ", err_code);
+				::munmap(m_base, m_mapped_size);
+				throw std::bad_alloc();
+			}
 		}
-		static void operator delete(void *ptr) NOEXCEPT {
-			if(::munmap(ptr, sizeof(StackStorage)) != 0){
+		~StackStorage(){
+			if(::munmap(m_base, m_mapped_size) != 0){
 				const int err_code = errno;
 				LOG_POSEIDON_ERROR("Failed to deallocate stack: err_code = ", err_code);
 				std::abort();
 			}
 		}
 
-		char bytes[256 * 1024];
+	public:
+		char *begin() const NOEXCEPT {
+			return static_cast<char *>(m_base) + m_guard_size;
+		}
+		char *end() const NOEXCEPT {
+			return static_cast<char *>(m_base) + m_mapped_size;
+		}
+		std::size_t size() const NOEXCEPT {
+			return m_mapped_size - m_guard_size;
+		}
 	};
 
 	Mutex g_pool_mutex;
-	boost::array<boost::scoped_ptr<StackStorage>, 64> g_stack_pool;
-	std::size_t g_stack_pool_size = 0;
+	// 空闲的栈。这个 vector 在 start() 中预留好空间，所以 push_back() 不会失败。
+	std::vector<StackStorage *> g_stack_pool;
 
-	struct FiberControl : NONCOPYABLE {
-		struct Initializer { };
+	StackStorage *allocate_stack(){
+		{
+			const Mutex::UniqueLock lock(g_pool_mutex);
+			if(!g_stack_pool.empty()){
+				const AUTO(stack, g_stack_pool.back());
+				g_stack_pool.pop_back();
+				return stack;
+			}
+		}
+		return new StackStorage(g_stack_size);
+	}
+	void deallocate_stack(StackStorage *stack) NOEXCEPT {
+		{
+			const Mutex::UniqueLock lock(g_pool_mutex);
+			if(g_stack_pool.size() < g_stack_pool.capacity()){
+				g_stack_pool.push_back(stack);
+				return;
+			}
+		}
+		delete stack;
+	}
+
+#ifdef __x86_64__
+	// 每个工作线程持有一个栈，新的纤程在上面运行，所以不让出的纤程不需要自己的栈。
+	// 纤程第一次让出时，这个栈连同上面的内容一起交给它，此后它一直在这个栈上运行，栈上对象的地址不会改变；
+	// 工作线程下次运行新的纤程之前再从池中取得一个栈。每个元素只由对应的工作线程访问。
+	std::vector<StackStorage *> g_worker_stacks;
+#endif
 
+	struct FiberControl;
+
+	typedef std::multimap<boost::uint64_t, FiberControl *> ExpiryMap;
+	typedef boost::unordered_multimap<const JobPromise *, FiberControl *> PromiseMap;
+
+	struct FiberControl : NONCOPYABLE {
+		const boost::weak_ptr<const void> category;
 		std::deque<JobElement> queue;
 
 		FiberState state;
-		boost::scoped_ptr<StackStorage> stack;
+		// 正在运行这个纤程的工作线程。挂起的纤程可以在任何工作线程中恢复。
+		std::size_t worker;
+		// 这个纤程自己的栈。在 x86_64 上，还没有让出过的纤程在工作线程的栈上运行，这个指针为空。
+		StackStorage *stack;
+#ifdef __x86_64__
+		void *inner_sp;
+		void *outer_sp;
+#else
 		::ucontext_t inner;
 		::ucontext_t outer;
+#endif
 
-		explicit FiberControl(Initializer)
-			: state(FS_READY)
+		// 侵入式的就绪队列。
+		bool ready;
+		FiberControl *next_ready;
+		// 正在等待 JobPromise 的纤程同时位于两个索引中。
+		bool parked;
+		ExpiryMap::iterator expiry_it;
+		PromiseMap::iterator promise_it;
+
+		explicit FiberControl(boost::weak_ptr<const void> category_)
+			: category(STD_MOVE(category_))
+			, state(FS_READY), worker(NO_WORKER), stack(NULLPTR)
+			, ready(false), next_ready(NULLPTR)
+			, parked(false), expiry_it(), promise_it()
 		{
-			Mutex::UniqueLock lock(g_pool_mutex);
-			if(g_stack_pool_size > 0){
-				stack.swap(g_stack_pool[--g_stack_pool_size]);
-			} else {
-				stack.reset(new StackStorage);
-			}
-			lock.unlock();
-
-#ifndef NDEBUG
+#ifdef __x86_64__
+			inner_sp = NULLPTR;
+			outer_sp = NULLPTR;
+#else
+#	ifndef NDEBUG
 			std::memset(&inner, 0xCC, sizeof(outer));
 			std::memset(&outer, 0xCC, sizeof(outer));
+#	endif
 #endif
 		}
 		~FiberControl(){
-			Mutex::UniqueLock lock(g_pool_mutex);
-			if(g_stack_pool_size < g_stack_pool.size()){
-				stack.swap(g_stack_pool[g_stack_pool_size++]);
-			} else {
-				stack.reset();
+			if(stack){
+				deallocate_stack(stack);
 			}
 		}
 	};
 
-	AUTO(g_current_fiber, (FiberControl *)0);
+	struct CategoryHasher {
+		std::size_t operator()(const boost::weak_ptr<const void> &category) const NOEXCEPT {
+			return category.owner_hash_value();
+		}
+	};
+	struct CategoryEqualTo {
+		bool operator()(const boost::weak_ptr<const void> &lhs, const boost::weak_ptr<const void> &rhs) const NOEXCEPT {
+			return !lhs.owner_before(rhs) && !rhs.owner_before(lhs);
+		}
+	};
+
+	struct ReadyQueue {
+		FiberControl *head;
+		FiberControl *tail;
+
+		ReadyQueue()
+			: head(NULLPTR), tail(NULLPTR)
+		{
+		}
+	};
+
+	__thread AUTO(t_current_fiber, (FiberControl *)0);
 
 	volatile bool g_running = false;
+	std::vector<boost::shared_ptr<Thread> > g_workers;
 
+	// 以下变量都由 g_fiber_mutex 保护。
 	Mutex g_fiber_mutex;
 	ConditionVariable g_new_job;
-	boost::container::map<boost::weak_ptr<const void>, FiberControl> g_fiber_map;
+	boost::unordered_map<boost::weak_ptr<const void>, FiberControl *, CategoryHasher, CategoryEqualTo> g_fiber_map;
+	ReadyQueue g_ready_queue;
+	ExpiryMap g_parked_by_expiry;
+	PromiseMap g_parked_by_promise;
+	// JobPromise 被满足时读取这个值，如果为零就不需要加锁。
+	volatile std::size_t g_parked_count = 0;
+
+	void push_ready(FiberControl *fiber) NOEXCEPT {
+		assert(!fiber->ready);
+		assert(!fiber->parked);
+
+		AUTO_REF(queue, g_ready_queue);
+		fiber->ready = true;
+		fiber->next_ready = NULLPTR;
+		if(queue.tail){
+			queue.tail->next_ready = fiber;
+		} else {
+			queue.head = fiber;
+		}
+		queue.tail = fiber;
+	}
+	FiberControl *pop_ready(ReadyQueue &queue) NOEXCEPT {
+		const AUTO(fiber, queue.head);
+		if(!fiber){
+			return NULLPTR;
+		}
+		queue.head = fiber->next_ready;
+		if(!queue.head){
+			queue.tail = NULLPTR;
+		}
+		fiber->ready = false;
+		fiber->next_ready = NULLPTR;
+		return fiber;
+	}
 
-	void fiber_proc(int low, int high) NOEXCEPT {
-		PROFILE_ME;
+	void park(FiberControl *fiber){
+		assert(!fiber->ready);
+		assert(!fiber->parked);
 
-		FiberControl *fiber;
-		const int params[2] = { low, high };
-		std::memcpy(&fiber, params, sizeof(fiber));
+		const AUTO_REF(elem, fiber->queue.front());
+		fiber->expiry_it = g_parked_by_expiry.insert(std::make_pair(elem.expiry_time, fiber));
+		try {
+			fiber->promise_it = g_parked_by_promise.insert(std::make_pair(elem.promise.get(), fiber));
+		} catch(...){
+			g_parked_by_expiry.erase(fiber->expiry_it);
+			throw;
+		}
+		fiber->parked = true;
+		atomic_add(g_parked_count, 1, ATOMIC_SEQ_CST);
+	}
+	void unpark(FiberControl *fiber) NOEXCEPT {
+		assert(fiber->parked);
+
+		atomic_sub(g_parked_count, 1, ATOMIC_RELAXED);
+		g_parked_by_promise.erase(fiber->promise_it);
+		g_parked_by_expiry.erase(fiber->expiry_it);
+		fiber->parked = false;
+	}
+
+	void fiber_proc(FiberControl *fiber) NOEXCEPT {
+		PROFILE_ME;
 
 		LOG_POSEIDON_TRACE("Entering fiber ", static_cast<void *>(fiber));
 		try {
@@ -139,25 +341,109 @@ namespace {
 		fiber->state = FS_READY;
 	}
 
-	void schedule_fiber(FiberControl *fiber) NOEXCEPT {
-		PROFILE_ME;
+#ifdef __x86_64__
+	void fiber_entry(FiberControl *fiber) NOEXCEPT {
+		fiber_proc(fiber);
 
-		if(fiber->state == FS_READY){
-			if(::getcontext(&(fiber->inner)) != 0){
-				const int err_code = errno;
-				LOG_POSEIDON_FATAL("::getcontext() failed: err_code = ", err_code);
-				std::abort();
+		::poseidon_job_dispatcher_switch_stack(&(fiber->inner_sp), fiber->outer_sp);
+		LOG_POSEIDON_FATAL("Finished fiber resumed?!");
+		std::abort();
+	}
+
+	void prepare_fiber_context(FiberControl *fiber){
+		StackStorage *run_stack = fiber->stack;
+		if(!run_stack){
+			AUTO_REF(worker_stack, g_worker_stacks.at(fiber->worker));
+			if(!worker_stack){
+				worker_stack = allocate_stack();
 			}
-			fiber->inner.uc_stack.ss_sp = fiber->stack.get();
-			fiber->inner.uc_stack.ss_size = sizeof(*(fiber->stack));
-			fiber->inner.uc_link = &(fiber->outer);
+			run_stack = worker_stack;
+		}
+
+		// 浮点控制字从当前线程继承。
+		boost::uint32_t mxcsr;
+		boost::uint16_t fpucw;
+		__asm__ __volatile__(
+			"stmxcsr %0 \n"
+			"fnstcw %1 \n"
+			: "=m"(mxcsr), "=m"(fpucw)
+		);
+
+		// 与 poseidon_job_dispatcher_switch_stack 中的压栈顺序相反。返回之后 %rsp 按 16 字节对齐。
+		const AUTO(top, reinterpret_cast<boost::uintptr_t>(run_stack->end()) & ~(boost::uintptr_t)15);
+		const AUTO(frame, reinterpret_cast<void **>(top) - 10);
+		std::memset(frame, 0, sizeof(void *) * 10);
+		std::memcpy(reinterpret_cast<char *>(frame) + 0, &mxcsr, sizeof(mxcsr));
+		std::memcpy(reinterpret_cast<char *>(frame) + 4, &fpucw, sizeof(fpucw));
+		frame[3] = reinterpret_cast<void *>(&fiber_entry);                         // %r13
+		frame[4] = fiber;                                                          // %r12
+		frame[7] = reinterpret_cast<void *>(&::poseidon_job_dispatcher_stack_entry); // 返回地址
+		fiber->inner_sp = frame;
+	}
+	void switch_into_fiber(FiberControl *fiber){
+		::poseidon_job_dispatcher_switch_stack(&(fiber->outer_sp), fiber->inner_sp);
+
+		if((fiber->state == FS_YIELDED) && !fiber->stack){
+			// 栈上的对象可能已经被其他任务或线程引用，不能移动，所以把整个栈交给这个纤程。
+			AUTO_REF(worker_stack, g_worker_stacks.at(fiber->worker));
+			fiber->stack = worker_stack;
+			worker_stack = NULLPTR;
+		}
+	}
+	void switch_out_of_fiber(FiberControl *fiber) NOEXCEPT {
+		::poseidon_job_dispatcher_switch_stack(&(fiber->inner_sp), fiber->outer_sp);
+	}
+#else
+	void fiber_entry(int low, int high) NOEXCEPT {
+		FiberControl *fiber;
+		const int params[2] = { low, high };
+		std::memcpy(&fiber, params, sizeof(fiber));
 
-			int params[2] = { };
-			std::memcpy(params, &fiber, sizeof(fiber));
-			::makecontext(&(fiber->inner), reinterpret_cast<void (*)()>(&fiber_proc), 2, params[0], params[1]);
+		fiber_proc(fiber);
+	}
+
+	void prepare_fiber_context(FiberControl *fiber){
+		if(!fiber->stack){
+			fiber->stack = allocate_stack();
+		}
+
+		if(::getcontext(&(fiber->inner)) != 0){
+			const int err_code = errno;
+			LOG_POSEIDON_FATAL("::getcontext() failed: err_code = ", err_code);
+			std::abort();
+		}
+		fiber->inner.uc_stack.ss_sp = fiber->stack->begin();
+		fiber->inner.uc_stack.ss_size = fiber->stack->size();
+		fiber->inner.uc_link = &(fiber->outer);
+
+		int params[2] = { };
+		std::memcpy(params, &fiber, sizeof(fiber));
+		::makecontext(&(fiber->inner), reinterpret_cast<void (*)()>(&fiber_entry), 2, params[0], params[1]);
+	}
+	void switch_into_fiber(FiberControl *fiber){
+		if(::swapcontext(&(fiber->outer), &(fiber->inner)) != 0){
+			const int err_code = errno;
+			LOG_POSEIDON_FATAL("::swapcontext() failed: err_code = ", err_code);
+			std::abort();
+		}
+	}
+	void switch_out_of_fiber(FiberControl *fiber) NOEXCEPT {
+		if(::swapcontext(&(fiber->inner), &(fiber->outer)) != 0){
+			const int err_code = errno;
+			LOG_POSEIDON_FATAL("::swapcontext() failed: err_code = ", err_code);
+			std::abort();
+		}
+	}
+#endif
+
+	void schedule_fiber(FiberControl *fiber){
+		PROFILE_ME;
+
+		if(fiber->state == FS_READY){
+			prepare_fiber_context(fiber);
 		}
 
-		g_current_fiber = fiber;
+		t_current_fiber = fiber;
 		const AUTO(profiler_hook, Profiler::begin_stack_switch());
 		{
 			if((fiber->state != FS_READY) && (fiber->state != FS_YIELDED)){
@@ -165,64 +451,162 @@ namespace {
 				std::abort();
 			}
 			fiber->state = FS_RUNNING;
-			if(::swapcontext(&(fiber->outer), &(fiber->inner)) != 0){
-				const int err_code = errno;
-				LOG_POSEIDON_FATAL("::swapcontext() failed: err_code = ", err_code);
-				std::abort();
-			}
+			switch_into_fiber(fiber);
 		}
 		Profiler::end_stack_switch(profiler_hook);
-		g_current_fiber = NULLPTR;
+		t_current_fiber = NULLPTR;
 	}
 
-	void really_pump_jobs() NOEXCEPT {
-		PROFILE_ME;
+	bool is_wakeable(const JobElement &elem, boost::uint64_t now) NOEXCEPT {
+		if(!elem.promise || elem.promise->is_satisfied()){
+			return true;
+		}
+		if((now < elem.expiry_time) && !(elem.insignificant && !atomic_load(g_running, ATOMIC_CONSUME))){
+			return false;
+		}
+		LOG_POSEIDON_WARNING("Job timed out");
+		return true;
+	}
 
-		Mutex::UniqueLock lock(g_fiber_mutex);
-		bool busy;
-		do {
-			busy = false;
-			for(AUTO(next, g_fiber_map.begin()), it = next; (next != g_fiber_map.end()) && (++next, true); it = next){
-				const AUTO(fiber, &(it->second));
-
-			_next:
-				if(fiber->queue.empty()){
-					g_fiber_map.erase(it);
+	// 唤醒超时的纤程。返回是否有纤程被唤醒。
+	bool wake_expired_fibers() NOEXCEPT {
+		if(g_parked_by_expiry.empty()){
+			return false;
+		}
+		const AUTO(now, get_fast_mono_clock());
+
+		bool woken = false;
+		if(!atomic_load(g_running, ATOMIC_CONSUME)){
+			// 正在退出，唤醒所有不重要的纤程。这种情况很少，直接遍历。
+			AUTO(it, g_parked_by_expiry.begin());
+			while(it != g_parked_by_expiry.end()){
+				const AUTO(fiber, it->second);
+				++it;
+				if(!is_wakeable(fiber->queue.front(), now)){
 					continue;
 				}
-				AUTO_REF(elem, fiber->queue.front());
-				if(elem.promise && !elem.promise->is_satisfied()){
-					const AUTO(now, get_fast_mono_clock());
-					if((now < elem.expiry_time) && !(elem.insignificant && !atomic_load(g_running, ATOMIC_CONSUME))){
-						continue;
-					}
-					LOG_POSEIDON_WARNING("Job timed out");
-				}
+				unpark(fiber);
+				push_ready(fiber);
+				woken = true;
+			}
+			return woken;
+		}
+		while(!g_parked_by_expiry.empty()){
+			const AUTO(fiber, g_parked_by_expiry.begin()->second);
+			if(!is_wakeable(fiber->queue.front(), now)){
+				break;
+			}
+			unpark(fiber);
+			push_ready(fiber);
+			woken = true;
+		}
+		return woken;
+	}
+
+	// 调用之前必须锁定 g_fiber_mutex。返回是否执行了任务。
+	bool pump_one_job(Mutex::UniqueLock &lock, std::size_t worker) NOEXCEPT {
+		PROFILE_ME;
+
+		if(wake_expired_fibers()){
+			// 可能唤醒了多个纤程，让其他线程也来执行。
+			g_new_job.broadcast();
+		}
+
+		const AUTO(fiber, pop_ready(g_ready_queue));
+		if(!fiber){
+			return false;
+		}
+		fiber->worker = worker;
 
-				elem.promise.reset();
-				busy = true;
+		AUTO_REF(elem, fiber->queue.front());
+		elem.promise.reset();
 
-				bool done;
-				lock.unlock();
+		bool done;
+		lock.unlock();
+		try {
+			if((fiber->state == FS_READY) && (elem.withdrawn && *elem.withdrawn)){
+				LOG_POSEIDON_DEBUG("Job is withdrawn");
+				done = true;
+			} else {
+				schedule_fiber(fiber);
+				done = (fiber->state == FS_READY);
+			}
+		} catch(...){
+			std::abort();
+		}
+		lock.lock();
+		fiber->worker = NO_WORKER;
+
+		if(done){
+			fiber->queue.pop_front();
+			if(fiber->queue.empty()){
+				g_fiber_map.erase(fiber->category);
+				delete fiber;
+			} else {
+				push_ready(fiber);
+			}
+		} else {
+			const AUTO_REF(yielded_elem, fiber->queue.front());
+			bool wakeable = is_wakeable(yielded_elem, get_fast_mono_clock());
+			if(!wakeable){
 				try {
-					if((fiber->state == FS_READY) && (elem.withdrawn && *elem.withdrawn)){
-						LOG_POSEIDON_DEBUG("Job is withdrawn");
-						done = true;
-					} else {
-						schedule_fiber(fiber);
-						done = (fiber->state == FS_READY);
+					park(fiber);
+					// 与 JobDispatcher::wake_fibers_for_promise() 配对。先发布 g_parked_count 再检查 JobPromise，
+					// 这样要么我们看到 JobPromise 已经被满足，要么满足它的线程看到这个纤程，不会漏掉唤醒。
+					atomic_fence(ATOMIC_SEQ_CST);
+					if(yielded_elem.promise->is_satisfied()){
+						unpark(fiber);
+						wakeable = true;
 					}
 				} catch(...){
-					std::abort();
+					wakeable = true;
 				}
-				lock.lock();
+			}
+			if(wakeable){
+				push_ready(fiber);
+			}
+		}
+		return true;
+	}
 
-				if(done){
-					fiber->queue.pop_front();
-					goto _next;
+	void really_pump_jobs(std::size_t worker) NOEXCEPT {
+		PROFILE_ME;
+
+		Mutex::UniqueLock lock(g_fiber_mutex);
+		while(pump_one_job(lock, worker)){
+			// 继续。
+		}
+	}
+
+	void worker_loop(std::size_t worker){
+		Mutex::UniqueLock lock(g_fiber_mutex);
+		for(;;){
+			while(pump_one_job(lock, worker)){
+				// 继续。
+			}
+			if(!atomic_load(g_running, ATOMIC_CONSUME)){
+				break;
+			}
+			// 等到下一个纤程超时为止。JobPromise 被满足时会直接唤醒我们。
+			if(g_parked_by_expiry.empty()){
+				g_new_job.wait(lock);
+			} else {
+				const AUTO(now, get_fast_mono_clock());
+				const AUTO(expiry_time, g_parked_by_expiry.begin()->first);
+				if(now < expiry_time){
+					g_new_job.timed_wait(lock, expiry_time - now);
 				}
 			}
-		} while(busy);
+		}
+	}
+
+	void worker_proc(std::size_t worker){
+		PROFILE_ME;
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Job worker ", worker, " started.");
+
+		worker_loop(worker);
+
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Job worker ", worker, " stopped.");
 	}
 }
 
@@ -231,6 +615,27 @@ void JobDispatcher::start(){
 
 	MainConfig::get(g_job_timeout, "job_timeout");
 	LOG_POSEIDON_DEBUG("Job timeout = ", g_job_timeout);
+
+	MainConfig::get(g_thread_count, "job_dispatcher_thread_count");
+	LOG_POSEIDON_DEBUG("Job dispatcher thread count = ", g_thread_count);
+	if(g_thread_count == 0){
+		g_thread_count = 1;
+	}
+
+	MainConfig::get(g_stack_size, "job_fiber_stack_size");
+	LOG_POSEIDON_DEBUG("Job fiber stack size = ", g_stack_size);
+	if(g_stack_size < 64 * 1024){
+		g_stack_size = 64 * 1024;
+	}
+
+	MainConfig::get(g_stack_pool_size, "job_fiber_stack_pool_size");
+	LOG_POSEIDON_DEBUG("Job fiber stack pool size = ", g_stack_pool_size);
+
+	const Mutex::UniqueLock lock(g_pool_mutex);
+	g_stack_pool.reserve(g_stack_pool_size);
+#ifdef __x86_64__
+	g_worker_stacks.resize(g_thread_count);
+#endif
 }
 void JobDispatcher::stop(){
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping job dispatcher...");
@@ -252,8 +657,20 @@ void JobDispatcher::stop(){
 			last_info_time = now;
 		}
 
-		really_pump_jobs();
+		really_pump_jobs(0);
+	}
+
+	const Mutex::UniqueLock lock(g_pool_mutex);
+#ifdef __x86_64__
+	for(AUTO(it, g_worker_stacks.begin()); it != g_worker_stacks.end(); ++it){
+		delete *it;
+	}
+	g_worker_stacks.clear();
+#endif
+	for(AUTO(it, g_stack_pool.begin()); it != g_stack_pool.end(); ++it){
+		delete *it;
 	}
+	g_stack_pool.clear();
 }
 
 void JobDispatcher::do_modal(){
@@ -264,22 +681,41 @@ void JobDispatcher::do_modal(){
 		std::abort();
 	}
 
-	for(;;){
-		really_pump_jobs();
-
-		Mutex::UniqueLock lock(g_fiber_mutex);
-		if(!atomic_load(g_running, ATOMIC_CONSUME)){
-			break;
+	try {
+		g_workers.reserve(g_thread_count);
+		for(std::size_t i = 1; i < g_thread_count; ++i){
+			const AUTO(thread, boost::make_shared<Thread>());
+			Thread(boost::bind(&worker_proc, i), "J   ").swap(*thread);
+			g_workers.push_back(thread);
+		}
+	} catch(...){
+		// 已经启动的线程必须在这里停止，否则它们会和调用者的 pump_all() 同时使用 0 号线程的栈。
+		LOG_POSEIDON_ERROR("Failed to start job workers. Stopping workers that have been started...");
+		atomic_store(g_running, false, ATOMIC_RELEASE);
+		{
+			const Mutex::UniqueLock lock(g_fiber_mutex);
+			g_new_job.broadcast();
+		}
+		for(AUTO(it, g_workers.begin()); it != g_workers.end(); ++it){
+			(*it)->join();
 		}
-		g_new_job.timed_wait(lock, 100);
+		g_workers.clear();
+		throw;
 	}
+
+	worker_loop(0);
+
+	for(AUTO(it, g_workers.begin()); it != g_workers.end(); ++it){
+		(*it)->join();
+	}
+	g_workers.clear();
 }
 bool JobDispatcher::is_running(){
 	return atomic_load(g_running, ATOMIC_CONSUME);
 }
 void JobDispatcher::quit_modal(){
 	atomic_store(g_running, false, ATOMIC_RELEASE);
-	g_new_job.signal();
+	g_new_job.broadcast();
 }
 
 void JobDispatcher::enqueue(boost::shared_ptr<JobBase> job, boost::shared_ptr<const bool> withdrawn){
@@ -294,15 +730,26 @@ void JobDispatcher::enqueue(boost::shared_ptr<JobBase> job, boost::shared_ptr<co
 	const Mutex::UniqueLock lock(g_fiber_mutex);
 	AUTO(it, g_fiber_map.find(category));
 	if(it == g_fiber_map.end()){
-		it = g_fiber_map.emplace(category, FiberControl::Initializer()).first;
+		const AUTO(fiber, new FiberControl(category));
+		try {
+			it = g_fiber_map.insert(std::make_pair(category, fiber)).first;
+		} catch(...){
+			delete fiber;
+			throw;
+		}
+	}
+	const AUTO(fiber, it->second);
+	fiber->queue.push_back(JobElement(STD_MOVE(job), STD_MOVE(withdrawn)));
+	// 如果这个纤程正在运行、挂起或者已经就绪，那么它的新任务会在当前任务完成之后被执行。
+	if((fiber->queue.size() == 1) && !fiber->ready){
+		push_ready(fiber);
+		g_new_job.signal();
 	}
-	it->second.queue.push_back(JobElement(STD_MOVE(job), STD_MOVE(withdrawn)));
-	g_new_job.signal();
 }
 void JobDispatcher::yield(boost::shared_ptr<const JobPromise> promise, bool insignificant){
 	PROFILE_ME;
 
-	const AUTO(fiber, g_current_fiber);
+	const AUTO(fiber, t_current_fiber);
 	if(!fiber){
 		DEBUG_THROW(Exception, sslit("No current fiber"));
 	}
@@ -322,11 +769,7 @@ void JobDispatcher::yield(boost::shared_ptr<const JobPromise> promise, bool insi
 	const AUTO(profiler_hook, Profiler::begin_stack_switch());
 	{
 		fiber->state = FS_YIELDED;
-		if(::swapcontext(&(fiber->inner), &(fiber->outer)) != 0){
-			const int err_code = errno;
-			LOG_POSEIDON_FATAL("::swapcontext() failed: err_code = ", err_code);
-			std::abort();
-		}
+		switch_out_of_fiber(fiber);
 	}
 	Profiler::end_stack_switch(profiler_hook);
 	LOG_POSEIDON_TRACE("Resumed to fiber ", static_cast<void *>(fiber));
@@ -336,10 +779,37 @@ void JobDispatcher::yield(boost::shared_ptr<const JobPromise> promise, bool insi
 	}
 }
 
+void JobDispatcher::wake_fibers_for_promise(const JobPromise *promise) NOEXCEPT {
+	PROFILE_ME;
+
+	// 参考 pump_one_job() 中的注释。
+	atomic_fence(ATOMIC_SEQ_CST);
+	if(atomic_load(g_parked_count, ATOMIC_SEQ_CST) == 0){
+		return;
+	}
+
+	const Mutex::UniqueLock lock(g_fiber_mutex);
+	bool woken = false;
+	for(;;){
+		const AUTO(it, g_parked_by_promise.find(promise));
+		if(it == g_parked_by_promise.end()){
+			break;
+		}
+		const AUTO(fiber, it->second);
+		unpark(fiber);
+		push_ready(fiber);
+		woken = true;
+	}
+	if(woken){
+		// 可能唤醒了多个纤程，让其他线程也来执行。
+		g_new_job.broadcast();
+	}
+}
+
 void JobDispatcher::pump_all(){
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Flushing all queued jobs...");
 
-	really_pump_jobs();
+	really_pump_jobs(0);
 }
 
 }
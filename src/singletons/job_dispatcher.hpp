@@ -23,7 +23,10 @@ struct JobDispatcher {
 	static void quit_modal();
 
 	static void enqueue(boost::shared_ptr<JobBase> job, boost::shared_ptr<const bool> withdrawn);
+	// 挂起的纤程可能在另一个工作线程中恢复，让出之前取得的线程相关的值（例如 pthread_self() 的结果）在恢复之后不再可靠。
 	static void yield(boost::shared_ptr<const JobPromise> promise, bool insignificant);
+	// JobPromise 被满足时调用，唤醒正在等待它的纤程。
+	static void wake_fibers_for_promise(const JobPromise *promise) NOEXCEPT;
 
 	static void pump_all();
 
@@ -0,0 +1,454 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2016, LH_Mouse. All wrongs reserved.
+
+#include "../precompiled.hpp"
+#include "log_daemon.hpp"
+#include "main_config.hpp"
+#include <sys/uio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <errno.h>
+#include "../log.hpp"
+#include "../atomic.hpp"
+#include "../thread.hpp"
+#include "../mutex.hpp"
+#include "../condition_variable.hpp"
+#include "../exception.hpp"
+
+namespace Poseidon {
+
+namespace {
+	enum OverflowPolicy {
+		OP_BLOCK,   // 等待守护线程腾出空间。
+		OP_DROP,    // 直接丢弃。
+		OP_COUNT,   // 丢弃，但是由守护线程输出丢弃的行数。
+	};
+
+	enum {
+		MIN_RING_SIZE       = 4096,
+		MAX_WRITE_VECS      = 256,
+	};
+
+	// 每条记录以这个结构开头，整条记录按照 8 字节对齐。fd 为 -1 表示填充到缓冲区末尾。
+	struct RecordHeader {
+		boost::uint32_t size;
+		boost::int32_t fd;
+	};
+
+	inline std::size_t get_record_size(std::size_t size){
+		return (sizeof(RecordHeader) + size + 7) & ~(std::size_t)7;
+	}
+
+	// 单生产者单消费者的环形缓冲区。生产者是所属线程，消费者是守护线程。
+	// 位置是只增不减的计数器，下标对容量（2 的幂）取模得到。
+	struct LogRing : NONCOPYABLE {
+		char *const buffer;
+		const std::size_t capacity;
+
+		volatile std::size_t write_pos;
+		volatile std::size_t read_pos;
+		// 所属线程退出之后设置，守护线程取完剩余的日志之后释放它。
+		volatile bool dead;
+
+		// 由 g_ring_mutex 保护。
+		LogRing *next;
+
+		explicit LogRing(std::size_t capacity_)
+			: buffer(new char[capacity_]), capacity(capacity_)
+			, write_pos(0), read_pos(0), dead(false)
+			, next(NULLPTR)
+		{
+		}
+		~LogRing(){
+			delete[] buffer;
+		}
+	};
+
+	OverflowPolicy g_overflow_policy = OP_BLOCK;
+	std::size_t g_ring_size = 65536;
+
+	volatile bool g_running = false;
+	Thread g_thread;
+
+	// 正在往环形缓冲区中写入的线程数。守护线程退出之前要等它们完成。
+	volatile std::size_t g_producer_count = 0;
+	volatile unsigned long g_dropped_count = 0;
+
+	Mutex g_ring_mutex;
+	LogRing *g_rings = NULLPTR;
+	// 取出日志的线程必须持有这个锁，这样 LogDaemon::flush() 可以和守护线程同时使用。
+	Mutex g_drain_mutex;
+
+	Mutex g_mutex;
+	ConditionVariable g_new_log;
+	ConditionVariable g_space_avail;
+	volatile bool g_sleeping = false;
+	volatile std::size_t g_blocked_count = 0;
+
+	__thread AUTO(t_ring, (LogRing *)0);
+	// 信号处理函数或者守护线程自己输出的日志直接同步写入。
+	__thread bool t_busy = false;
+	// 线程正在退出，缓冲区已经交给守护线程释放。此后的日志直接同步写入，不再创建新的缓冲区。
+	__thread bool t_exiting = false;
+
+	::pthread_key_t g_ring_key;
+	::pthread_once_t g_ring_key_once = PTHREAD_ONCE_INIT;
+
+	void ring_key_destructor(void *ptr) NOEXCEPT {
+		t_exiting = true;
+		t_ring = NULLPTR;
+		atomic_store(static_cast<LogRing *>(ptr)->dead, true, ATOMIC_RELEASE);
+	}
+	void create_ring_key() NOEXCEPT {
+		if(::pthread_key_create(&g_ring_key, &ring_key_destructor) != 0){
+			std::abort();
+		}
+	}
+
+	LogRing *get_ring() NOEXCEPT {
+		AUTO(ring, t_ring);
+		if(ring){
+			return ring;
+		}
+		if(t_exiting){
+			return NULLPTR;
+		}
+		try {
+			::pthread_once(&g_ring_key_once, &create_ring_key);
+			ring = new LogRing(g_ring_size);
+			if(::pthread_setspecific(g_ring_key, ring) != 0){
+				delete ring;
+				return NULLPTR;
+			}
+			const Mutex::UniqueLock lock(g_ring_mutex);
+			ring->next = g_rings;
+			g_rings = ring;
+		} catch(...){
+			return NULLPTR;
+		}
+		t_ring = ring;
+		return ring;
+	}
+
+	void wake_daemon() NOEXCEPT {
+		atomic_fence(ATOMIC_SEQ_CST);
+		if(!atomic_load(g_sleeping, ATOMIC_SEQ_CST)){
+			return;
+		}
+		try {
+			const Mutex::UniqueLock lock(g_mutex);
+			g_new_log.signal();
+		} catch(...){
+		}
+	}
+
+	void write_all(int fd, ::iovec *vecs, std::size_t count) NOEXCEPT {
+		while(count > 0){
+			const AUTO(result, ::writev(fd, vecs, static_cast<int>(count)));
+			if(result < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				break;
+			}
+			AUTO(bytes_written, static_cast<std::size_t>(result));
+			while((count > 0) && (bytes_written >= vecs->iov_len)){
+				bytes_written -= vecs->iov_len;
+				++vecs;
+				--count;
+			}
+			if(count > 0){
+				vecs->iov_base = static_cast<char *>(vecs->iov_base) + bytes_written;
+				vecs->iov_len -= bytes_written;
+			}
+		}
+	}
+
+	// 返回写出的字节数。
+	std::size_t drain_ring(LogRing *ring) NOEXCEPT {
+		std::size_t bytes_total = 0;
+
+		const AUTO(mask, ring->capacity - 1);
+		AUTO(read_pos, ring->read_pos);
+		const AUTO(write_pos, atomic_load(ring->write_pos, ATOMIC_ACQUIRE));
+		while(read_pos != write_pos){
+			// 相邻的写入同一个文件的记录合并为一次 writev()。
+			::iovec vecs[MAX_WRITE_VECS];
+			std::size_t count = 0;
+			int fd = -1;
+			AUTO(pos, read_pos);
+			while((pos != write_pos) && (count < MAX_WRITE_VECS)){
+				RecordHeader header;
+				std::memcpy(&header, ring->buffer + (pos & mask), sizeof(header));
+				if(header.fd < 0){
+					pos += sizeof(header) + header.size;
+					continue;
+				}
+				if((fd >= 0) && (header.fd != fd)){
+					break;
+				}
+				fd = header.fd;
+				vecs[count].iov_base = ring->buffer + (pos & mask) + sizeof(header);
+				vecs[count].iov_len = header.size;
+				++count;
+				bytes_total += header.size;
+				pos += get_record_size(header.size);
+			}
+			if(count > 0){
+				write_all(fd, vecs, count);
+			}
+			read_pos = pos;
+			atomic_store(ring->read_pos, read_pos, ATOMIC_RELEASE);
+		}
+		return bytes_total;
+	}
+
+	void wake_blocked_producers() NOEXCEPT {
+		if(!atomic_load(g_blocked_count, ATOMIC_CONSUME)){
+			return;
+		}
+		try {
+			const Mutex::UniqueLock lock(g_mutex);
+			g_space_avail.broadcast();
+		} catch(...){
+		}
+	}
+
+	// 返回是否有日志被写出。
+	bool drain_all() NOEXCEPT {
+		bool busy = false;
+
+		Mutex::UniqueLock drain_lock(g_drain_mutex);
+		LogRing *ring;
+		{
+			const Mutex::UniqueLock lock(g_ring_mutex);
+			ring = g_rings;
+		}
+		// 新的缓冲区只会插入到链表头，只有这个线程会删除节点，所以这里不需要加锁。
+		while(ring){
+			const AUTO(next, ring->next);
+			const bool dead = atomic_load(ring->dead, ATOMIC_ACQUIRE);
+			if(drain_ring(ring) != 0){
+				busy = true;
+			}
+			if(dead){
+				const Mutex::UniqueLock lock(g_ring_mutex);
+				AUTO(pprev, &g_rings);
+				while(*pprev != ring){
+					pprev = &((*pprev)->next);
+				}
+				*pprev = next;
+				delete ring;
+			}
+			ring = next;
+		}
+		drain_lock.unlock();
+		if(busy){
+			wake_blocked_producers();
+		}
+
+		const AUTO(dropped, atomic_exchange(g_dropped_count, 0ul, ATOMIC_RELAXED));
+		if(dropped != 0){
+			LOG_POSEIDON_WARNING("Log buffer overflowed: ", dropped, " line(s) dropped");
+		}
+		return busy;
+	}
+
+	bool has_pending_logs() NOEXCEPT {
+		const Mutex::UniqueLock lock(g_ring_mutex);
+		for(AUTO(ring, g_rings); ring; ring = ring->next){
+			if(atomic_load(ring->write_pos, ATOMIC_SEQ_CST) != ring->read_pos){
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void daemon_loop(){
+		for(;;){
+			while(drain_all()){
+				// noop
+			}
+
+			if(!atomic_load(g_running, ATOMIC_CONSUME)){
+				// 等正在写入的线程完成之后再取一次。
+				while(atomic_load(g_producer_count, ATOMIC_CONSUME) != 0){
+					atomic_pause();
+				}
+				drain_all();
+				break;
+			}
+
+			Mutex::UniqueLock lock(g_mutex);
+			atomic_store(g_sleeping, true, ATOMIC_SEQ_CST);
+			if(!has_pending_logs()){
+				g_new_log.timed_wait(lock, 100);
+			}
+			atomic_store(g_sleeping, false, ATOMIC_RELAXED);
+		}
+	}
+
+	void thread_proc(){
+		t_busy = true;
+		LOG_POSEIDON_INFO("Log daemon started.");
+
+		daemon_loop();
+
+		LOG_POSEIDON_INFO("Log daemon stopped.");
+	}
+}
+
+void LogDaemon::start(){
+	// 守护线程启动之前的日志都是同步写入的。先读取配置，这样所有的缓冲区都使用配置的大小。
+	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Starting log daemon...");
+
+	std::string overflow_policy;
+	MainConfig::get(overflow_policy, "log_overflow_policy");
+	LOG_POSEIDON_DEBUG("Log overflow policy = ", overflow_policy);
+	if(overflow_policy.empty() || (overflow_policy == "block")){
+		g_overflow_policy = OP_BLOCK;
+	} else if(overflow_policy == "drop"){
+		g_overflow_policy = OP_DROP;
+	} else if(overflow_policy == "count"){
+		g_overflow_policy = OP_COUNT;
+	} else {
+		LOG_POSEIDON_ERROR("Invalid log_overflow_policy: ", overflow_policy);
+		DEBUG_THROW(Exception, sslit("Invalid log_overflow_policy"));
+	}
+
+	MainConfig::get(g_ring_size, "log_buffer_size");
+	LOG_POSEIDON_DEBUG("Log buffer size = ", g_ring_size);
+	std::size_t ring_size = MIN_RING_SIZE;
+	while(ring_size < g_ring_size){
+		ring_size *= 2;
+	}
+	g_ring_size = ring_size;
+
+	if(atomic_exchange(g_running, true, ATOMIC_ACQ_REL) != false){
+		LOG_POSEIDON_FATAL("Only one daemon is allowed at the same time.");
+		std::abort();
+	}
+	Thread(thread_proc, "   L").swap(g_thread);
+}
+void LogDaemon::stop(){
+	if(atomic_exchange(g_running, false, ATOMIC_ACQ_REL) == false){
+		return;
+	}
+	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping log daemon...");
+
+	{
+		const Mutex::UniqueLock lock(g_mutex);
+		g_new_log.signal();
+		g_space_avail.broadcast();
+	}
+	if(g_thread.joinable()){
+		g_thread.join();
+	}
+}
+
+void LogDaemon::flush() NOEXCEPT {
+	if(t_busy){
+		return;
+	}
+	t_busy = true;
+
+	bool busy = false;
+	try {
+		const Mutex::UniqueLock drain_lock(g_drain_mutex);
+		LogRing *ring;
+		{
+			const Mutex::UniqueLock lock(g_ring_mutex);
+			ring = g_rings;
+		}
+		// 节点只会被守护线程在持有 g_drain_mutex 时删除。
+		while(ring){
+			if(drain_ring(ring) != 0){
+				busy = true;
+			}
+			ring = ring->next;
+		}
+	} catch(...){
+	}
+	if(busy){
+		wake_blocked_producers();
+	}
+
+	t_busy = false;
+}
+
+bool LogDaemon::enqueue(int fd, const char *data, std::size_t size) NOEXCEPT {
+	if(t_busy){
+		return false;
+	}
+	atomic_add(g_producer_count, 1, ATOMIC_SEQ_CST);
+	if(!atomic_load(g_running, ATOMIC_SEQ_CST)){
+		atomic_sub(g_producer_count, 1, ATOMIC_RELEASE);
+		return false;
+	}
+	t_busy = true;
+
+	bool queued = false;
+	const AUTO(ring, get_ring());
+	if(ring && (get_record_size(size) <= ring->capacity / 2)){
+		const AUTO(mask, ring->capacity - 1);
+		const AUTO(write_pos, ring->write_pos);
+		const AUTO(offset, write_pos & mask);
+		// 如果放不下，先填充到缓冲区末尾。
+		std::size_t padding = 0;
+		if(ring->capacity - offset < get_record_size(size)){
+			padding = ring->capacity - offset;
+		}
+		const AUTO(needed, padding + get_record_size(size));
+
+		bool has_space = true;
+		while(ring->capacity - (write_pos - atomic_load(ring->read_pos, ATOMIC_ACQUIRE)) < needed){
+			if(g_overflow_policy != OP_BLOCK){
+				if(g_overflow_policy == OP_COUNT){
+					atomic_add(g_dropped_count, 1ul, ATOMIC_RELAXED);
+				}
+				has_space = false;
+				break;
+			}
+			if(!atomic_load(g_running, ATOMIC_CONSUME)){
+				has_space = false;
+				break;
+			}
+			try {
+				atomic_add(g_blocked_count, 1, ATOMIC_SEQ_CST);
+				Mutex::UniqueLock lock(g_mutex);
+				g_new_log.signal();
+				g_space_avail.timed_wait(lock, 1);
+				lock.unlock();
+				atomic_sub(g_blocked_count, 1, ATOMIC_RELAXED);
+			} catch(...){
+				atomic_sub(g_blocked_count, 1, ATOMIC_RELAXED);
+				has_space = false;
+				break;
+			}
+		}
+		if(has_space){
+			RecordHeader header;
+			if(padding != 0){
+				header.size = static_cast<boost::uint32_t>(padding - sizeof(header));
+				header.fd = -1;
+				std::memcpy(ring->buffer + offset, &header, sizeof(header));
+			}
+			const AUTO(record_offset, (write_pos + padding) & mask);
+			header.size = static_cast<boost::uint32_t>(size);
+			header.fd = fd;
+			std::memcpy(ring->buffer + record_offset, &header, sizeof(header));
+			std::memcpy(ring->buffer + record_offset + sizeof(header), data, size);
+			atomic_store(ring->write_pos, write_pos + needed, ATOMIC_RELEASE);
+			wake_daemon();
+		}
+		// 丢弃的日志也算作已处理。如果等待时守护线程退出了，由调用者自己写入。
+		queued = has_space || (g_overflow_policy != OP_BLOCK);
+	}
+
+	t_busy = false;
+	atomic_sub(g_producer_count, 1, ATOMIC_RELEASE);
+	return queued;
+}
+
+}
@@ -0,0 +1,28 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2016, LH_Mouse. All wrongs reserved.
+
+#ifndef POSEIDON_SINGLETONS_LOG_DAEMON_HPP_
+#define POSEIDON_SINGLETONS_LOG_DAEMON_HPP_
+
+#include "../cxx_ver.hpp"
+#include <cstddef>
+
+namespace Poseidon {
+
+struct LogDaemon {
+	static void start();
+	static void stop();
+
+	// 由 Logger 调用，把一行日志放入当前线程的缓冲区中，由守护线程批量写出。
+	// 如果守护线程没有运行或者日志太长，返回 false，调用者应当自己同步写入。
+	static bool enqueue(int fd, const char *data, std::size_t size) NOEXCEPT;
+	// 在当前线程中写出所有缓冲区中的日志。由 Logger 在同步写入致命错误之前调用，保证之前的日志先被写出。
+	static void flush() NOEXCEPT;
+
+private:
+	LogDaemon();
+};
+
+}
+
+#endif
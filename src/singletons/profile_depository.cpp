@@ -3,8 +3,14 @@
 
 #include "../precompiled.hpp"
 #include "profile_depository.hpp"
-#include <boost/container/flat_map.hpp>
 #include <cstring>
+#include <new>
+#include <cmath>
+#include <pthread.h>
+#include <time.h>
+#ifdef __x86_64__
+#   include <cpuid.h>
+#endif
 #include "main_config.hpp"
 #include "../mutex.hpp"
 #include "../atomic.hpp"
@@ -14,6 +20,50 @@
 namespace Poseidon {
 
 namespace {
+	enum {
+		COUNTERS_PER_CHUNK  = 256,
+		MAX_CHUNK_COUNT     = 256,
+	};
+
+	// CallSite::index 的特殊值，表示调用点太多，不再统计。
+	const std::size_t INDEX_EXHAUSTED = (std::size_t)-1;
+
+	// 延迟直方图是对数-线性的：每个 2 的幂次区间再等分为 2^LATENCY_SUB_BUCKET_BITS 个桶，相对误差不超过 1/16。
+	// 超过 LATENCY_MAX_NS（约 137 秒）的延迟都计入最后一个桶，但最大值仍然是准确的。
+	const unsigned LATENCY_SUB_BUCKET_BITS = 4;
+	const boost::uint64_t LATENCY_SUB_BUCKET_COUNT = 1ull << LATENCY_SUB_BUCKET_BITS;
+	const boost::uint64_t LATENCY_MAX_NS = (1ull << 37) - 1;
+	const std::size_t LATENCY_BUCKET_COUNT = (37 - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS;
+
+	std::size_t get_latency_bucket(boost::uint64_t ns) NOEXCEPT {
+		if(ns < LATENCY_SUB_BUCKET_COUNT){
+			return static_cast<std::size_t>(ns);
+		}
+		if(ns > LATENCY_MAX_NS){
+			ns = LATENCY_MAX_NS;
+		}
+		const unsigned shift = static_cast<unsigned>(63 - __builtin_clzll(ns)) - LATENCY_SUB_BUCKET_BITS;
+		return static_cast<std::size_t>(((shift + 1ull) << LATENCY_SUB_BUCKET_BITS) + ((ns >> shift) & (LATENCY_SUB_BUCKET_COUNT - 1)));
+	}
+	// 返回落入这个桶的最大值。
+	boost::uint64_t get_latency_bucket_upper_bound(std::size_t bucket) NOEXCEPT {
+		if(bucket < LATENCY_SUB_BUCKET_COUNT){
+			return bucket;
+		}
+		const unsigned shift = static_cast<unsigned>(bucket >> LATENCY_SUB_BUCKET_BITS) - 1;
+		const boost::uint64_t sub = bucket & (LATENCY_SUB_BUCKET_COUNT - 1);
+		return ((LATENCY_SUB_BUCKET_COUNT + sub + 1) << shift) - 1;
+	}
+
+	// 每次重置时递增。直方图的纪元和它不同时视为空的。
+	volatile unsigned long g_latency_epoch = 1;
+
+	struct LatencyHistogram {
+		volatile unsigned long epoch;
+		volatile boost::uint64_t max;
+		volatile boost::uint64_t counts[LATENCY_BUCKET_COUNT];
+	};
+
 	struct ProfileKey {
 		const char *file;
 		unsigned long line;
@@ -37,17 +87,318 @@ namespace {
 		volatile unsigned long long samples;
 		volatile unsigned long long ns_total;
 		volatile unsigned long long ns_exclusive;
+		// 第一次记录延迟时分配。
+		LatencyHistogram *volatile latency;
 
 		ProfileCounters()
-			: samples(0), ns_total(0), ns_exclusive(0)
+			: samples(0), ns_total(0), ns_exclusive(0), latency(NULLPTR)
 		{
 		}
+		~ProfileCounters(){
+			delete latency;
+		}
+	};
+
+	struct ProfileTotals {
+		unsigned long long samples;
+		unsigned long long ns_total;
+		unsigned long long ns_exclusive;
+		// 只包含当前纪元的数据，没有数据时为空。
+		boost::uint64_t latency_max;
+		std::vector<boost::uint64_t> latency_counts;
+
+		ProfileTotals()
+			: samples(0), ns_total(0), ns_exclusive(0), latency_max(0)
+		{
+		}
+
+		void add(const ProfileCounters &counters, unsigned long epoch){
+			samples      += atomic_load(counters.samples, ATOMIC_RELAXED);
+			ns_total     += atomic_load(counters.ns_total, ATOMIC_RELAXED);
+			ns_exclusive += atomic_load(counters.ns_exclusive, ATOMIC_RELAXED);
+
+			const AUTO(latency, atomic_load(counters.latency, ATOMIC_ACQUIRE));
+			if(!latency || (atomic_load(latency->epoch, ATOMIC_ACQUIRE) != epoch)){
+				return;
+			}
+			latency_counts.resize(LATENCY_BUCKET_COUNT);
+			for(std::size_t i = 0; i < LATENCY_BUCKET_COUNT; ++i){
+				latency_counts[i] += atomic_load(latency->counts[i], ATOMIC_RELAXED);
+			}
+			latency_max = std::max<boost::uint64_t>(latency_max, atomic_load(latency->max, ATOMIC_RELAXED));
+		}
+		void add(const ProfileTotals &rhs){
+			samples      += rhs.samples;
+			ns_total     += rhs.ns_total;
+			ns_exclusive += rhs.ns_exclusive;
+
+			if(rhs.latency_counts.empty()){
+				return;
+			}
+			latency_counts.resize(LATENCY_BUCKET_COUNT);
+			for(std::size_t i = 0; i < LATENCY_BUCKET_COUNT; ++i){
+				latency_counts[i] += rhs.latency_counts[i];
+			}
+			latency_max = std::max(latency_max, rhs.latency_max);
+		}
+		void clear_latency() NOEXCEPT {
+			latency_max = 0;
+			latency_counts.clear();
+		}
+	};
+
+	// 每个线程一份，只有所属线程写入，snapshot() 读取。
+	// 计数器按 CallSite::index 分块，块在第一次用到时分配，在线程退出之前不会释放。
+	struct ThreadCounters {
+		ThreadCounters *prev;
+		ThreadCounters *next;
+		ProfileCounters *volatile chunks[MAX_CHUNK_COUNT];
+
+		ThreadCounters()
+			: prev(NULLPTR), next(NULLPTR)
+		{
+			for(std::size_t i = 0; i < MAX_CHUNK_COUNT; ++i){
+				chunks[i] = NULLPTR;
+			}
+		}
+		~ThreadCounters(){
+			for(std::size_t i = 0; i < MAX_CHUNK_COUNT; ++i){
+				delete[] chunks[i];
+			}
+		}
 	};
 
 	bool g_enabled = true;
 
+	// 为 true 时 get_ticks() 读取 TSC，否则返回 CLOCK_MONOTONIC 的纳秒数。
+	volatile bool g_use_tsc = false;
+	// TSC 周期数乘以 g_tsc_mult 再右移 TSC_MULT_SHIFT 位得到纳秒数。
+	const unsigned TSC_MULT_SHIFT = 32;
+	volatile boost::uint64_t g_tsc_mult = 0;
+
+	boost::uint64_t read_monotonic_ns() NOEXCEPT {
+		::timespec ts;
+		if(::clock_gettime(CLOCK_MONOTONIC, &ts) != 0){
+			LOG_POSEIDON_FATAL("Monotonic clock is not supported.");
+			std::abort();
+		}
+		return (boost::uint64_t)ts.tv_sec * 1000000000 + (unsigned long)ts.tv_nsec;
+	}
+
+#ifdef __x86_64__
+	boost::uint64_t read_tsc() NOEXCEPT {
+		boost::uint64_t tsc;
+		// rdtscp 等待之前的指令执行完毕，不会被乱序到被测量的代码中间。
+		__asm__ __volatile__(
+			"rdtscp \n"
+			"shlq $32, %%rdx \n"
+			"orq %%rdx, %%rax \n"
+			: "=a"(tsc) : : "cx", "dx"
+		);
+		return tsc;
+	}
+
+	bool is_invariant_tsc_supported() NOEXCEPT {
+		unsigned eax, ebx, ecx, edx;
+		if(!::__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || (eax < 0x80000007)){
+			return false;
+		}
+		::__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+		if(!(edx & (1u << 27))){ // RDTSCP
+			return false;
+		}
+		::__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+		if(!(edx & (1u << 8))){ // 频率不变，并且在各个核心之间同步。
+			return false;
+		}
+		return true;
+	}
+
+	// 在两次读取 CLOCK_MONOTONIC 之间读取 TSC，取间隔最短的一次，以中点作为对应的时间。
+	void read_clock_pair(boost::uint64_t &ns, boost::uint64_t &tsc) NOEXCEPT {
+		boost::uint64_t best_span = (boost::uint64_t)-1;
+		for(unsigned i = 0; i < 16; ++i){
+			const AUTO(ns_before, read_monotonic_ns());
+			const AUTO(tsc_now, read_tsc());
+			const AUTO(ns_after, read_monotonic_ns());
+			const AUTO(span, ns_after - ns_before);
+			if(span < best_span){
+				best_span = span;
+				ns = ns_before + span / 2;
+				tsc = tsc_now;
+			}
+		}
+	}
+
+	boost::uint64_t calibrate_tsc() NOEXCEPT {
+		boost::uint64_t ns_begin, tsc_begin, ns_end, tsc_end;
+		read_clock_pair(ns_begin, tsc_begin);
+		::timespec req;
+		req.tv_sec = 0;
+		req.tv_nsec = 50000000;
+		while(::nanosleep(&req, &req) != 0){
+			// 被信号打断，继续睡眠剩余的时间。
+		}
+		read_clock_pair(ns_end, tsc_end);
+		if(tsc_end <= tsc_begin){
+			return 0;
+		}
+		return ((ns_end - ns_begin) << TSC_MULT_SHIFT) / (tsc_end - tsc_begin);
+	}
+#endif
+
+	boost::uint64_t ticks_to_ns(boost::uint64_t ticks) NOEXCEPT {
+#ifdef __x86_64__
+		if(atomic_load(g_use_tsc, ATOMIC_RELAXED)){
+			const AUTO(mult, atomic_load(g_tsc_mult, ATOMIC_RELAXED));
+			return static_cast<boost::uint64_t>((static_cast<unsigned __int128>(ticks) * mult) >> TSC_MULT_SHIFT);
+		}
+#endif
+		return ticks;
+	}
+
+	// 返回连续读取时钟时每次读取的平均纳秒数。
+	double measure_clock_overhead() NOEXCEPT {
+		const unsigned count = 100000;
+		const AUTO(ns_begin, read_monotonic_ns());
+		for(unsigned i = 0; i < count; ++i){
+			ProfileDepository::get_ticks();
+		}
+		const AUTO(ns_end, read_monotonic_ns());
+		return static_cast<double>(ns_end - ns_begin) / count;
+	}
+
+	// 以下变量都由 g_mutex 保护。
 	Mutex g_mutex;
-	boost::container::flat_map<ProfileKey, ProfileCounters> g_profile;
+	// 下标是 CallSite::index - 1。
+	std::vector<const Profiler::CallSite *> g_sites;
+	ThreadCounters *g_threads = NULLPTR;
+	// 已经退出的线程的计数器合并到这里。
+	std::vector<ProfileTotals> g_retired;
+
+	__thread AUTO(t_counters, (ThreadCounters *)0);
+
+	::pthread_key_t g_counters_key;
+	::pthread_once_t g_counters_key_once = PTHREAD_ONCE_INIT;
+
+	void counters_key_destructor(void *ptr) NOEXCEPT {
+		const AUTO(thread, static_cast<ThreadCounters *>(ptr));
+		t_counters = NULLPTR;
+		{
+			const Mutex::UniqueLock lock(g_mutex);
+			try {
+				if(g_retired.size() < g_sites.size()){
+					g_retired.resize(g_sites.size());
+				}
+				const AUTO(epoch, atomic_load(g_latency_epoch, ATOMIC_RELAXED));
+				for(std::size_t slot = 0; slot < g_sites.size(); ++slot){
+					const AUTO(chunk, thread->chunks[slot / COUNTERS_PER_CHUNK]);
+					if(!chunk){
+						continue;
+					}
+					g_retired.at(slot).add(chunk[slot % COUNTERS_PER_CHUNK], epoch);
+				}
+			} catch(...){
+			}
+			if(thread->prev){
+				thread->prev->next = thread->next;
+			} else {
+				g_threads = thread->next;
+			}
+			if(thread->next){
+				thread->next->prev = thread->prev;
+			}
+		}
+		delete thread;
+	}
+	void create_counters_key() NOEXCEPT {
+		if(::pthread_key_create(&g_counters_key, &counters_key_destructor) != 0){
+			std::abort();
+		}
+	}
+
+	std::size_t register_site(Profiler::CallSite &site) NOEXCEPT {
+		const Mutex::UniqueLock lock(g_mutex);
+		AUTO(index, atomic_load(site.index, ATOMIC_RELAXED));
+		if(index != 0){
+			return index;
+		}
+		if(g_sites.size() >= COUNTERS_PER_CHUNK * MAX_CHUNK_COUNT){
+			index = INDEX_EXHAUSTED;
+		} else {
+			try {
+				g_sites.push_back(&site);
+				index = g_sites.size();
+			} catch(...){
+				return 0;
+			}
+		}
+		atomic_store(site.index, index, ATOMIC_RELAXED);
+		return index;
+	}
+
+	ProfileCounters *get_counters(std::size_t slot) NOEXCEPT {
+		AUTO(thread, t_counters);
+		if(!thread){
+			::pthread_once(&g_counters_key_once, &create_counters_key);
+			thread = new(std::nothrow) ThreadCounters;
+			if(!thread){
+				return NULLPTR;
+			}
+			if(::pthread_setspecific(g_counters_key, thread) != 0){
+				delete thread;
+				return NULLPTR;
+			}
+			{
+				const Mutex::UniqueLock lock(g_mutex);
+				thread->next = g_threads;
+				if(g_threads){
+					g_threads->prev = thread;
+				}
+				g_threads = thread;
+			}
+			t_counters = thread;
+		}
+		AUTO_REF(chunk_ref, thread->chunks[slot / COUNTERS_PER_CHUNK]);
+		AUTO(chunk, chunk_ref);
+		if(!chunk){
+			chunk = new(std::nothrow) ProfileCounters[COUNTERS_PER_CHUNK];
+			if(!chunk){
+				return NULLPTR;
+			}
+			atomic_store(chunk_ref, chunk, ATOMIC_RELEASE);
+		}
+		return chunk + slot % COUNTERS_PER_CHUNK;
+	}
+
+	unsigned long long get_latency_percentile(const ProfileTotals &totals, boost::uint64_t samples, double ratio){
+		if(samples == 0){
+			return 0;
+		}
+		const AUTO(target, std::max<boost::uint64_t>(static_cast<boost::uint64_t>(std::ceil(static_cast<double>(samples) * ratio)), 1));
+		boost::uint64_t count = 0;
+		for(std::size_t i = 0; i < totals.latency_counts.size(); ++i){
+			count += totals.latency_counts[i];
+			if(count >= target){
+				return std::min(get_latency_bucket_upper_bound(i), totals.latency_max);
+			}
+		}
+		return totals.latency_max;
+	}
+
+	struct SiteTotals {
+		ProfileKey key;
+		ProfileTotals totals;
+
+		SiteTotals(const ProfileKey &key_, const ProfileTotals &totals_)
+			: key(key_), totals(totals_)
+		{
+		}
+
+		bool operator<(const SiteTotals &rhs) const {
+			return key < rhs.key;
+		}
+	};
 }
 
 void ProfileDepository::start(){
@@ -55,6 +406,39 @@ void ProfileDepository::start(){
 
 	MainConfig::get(g_enabled, "enable_profiler");
 	LOG_POSEIDON_DEBUG("Enable profiler = ", g_enabled);
+
+	bool use_tsc = false;
+	MainConfig::get(use_tsc, "profiler_use_tsc");
+	LOG_POSEIDON_DEBUG("Profiler uses TSC = ", use_tsc);
+
+	if(!g_enabled){
+		return;
+	}
+
+	const AUTO(monotonic_overhead, measure_clock_overhead());
+	if(!use_tsc){
+		LOG_POSEIDON_INFO("Profiler clock overhead: CLOCK_MONOTONIC = ", monotonic_overhead, " ns");
+		return;
+	}
+#ifdef __x86_64__
+	if(!is_invariant_tsc_supported()){
+		LOG_POSEIDON_WARNING("Invariant TSC is not supported by this CPU. Profiler will use CLOCK_MONOTONIC.");
+		return;
+	}
+	const AUTO(mult, calibrate_tsc());
+	if(mult == 0){
+		LOG_POSEIDON_WARNING("TSC calibration failed. Profiler will use CLOCK_MONOTONIC.");
+		return;
+	}
+	LOG_POSEIDON_INFO("TSC frequency = ", static_cast<double>(1ull << TSC_MULT_SHIFT) * 1e3 / static_cast<double>(mult), " MHz");
+	atomic_store(g_tsc_mult, mult, ATOMIC_RELAXED);
+	atomic_store(g_use_tsc, true, ATOMIC_RELEASE);
+
+	const AUTO(tsc_overhead, ticks_to_ns(static_cast<boost::uint64_t>(measure_clock_overhead() * 1000)) / 1000.0);
+	LOG_POSEIDON_INFO("Profiler clock overhead: CLOCK_MONOTONIC = ", monotonic_overhead, " ns, TSC = ", tsc_overhead, " ns");
+#else
+	LOG_POSEIDON_WARNING("TSC is not supported on this platform. Profiler will use CLOCK_MONOTONIC.");
+#endif
 }
 void ProfileDepository::stop(){
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping profile depository...");
@@ -64,38 +448,152 @@ bool ProfileDepository::is_enabled(){
 	return g_enabled;
 }
 
-void ProfileDepository::accumulate(const char *file, unsigned long line, const char *func,
-	double total, double exclusive) NOEXCEPT
-{
-	try {
-		const Mutex::UniqueLock lock(g_mutex);
-		AUTO_REF(counters, g_profile[ProfileKey(file, line, func)]);
-		atomic_add(counters.samples,      1,               ATOMIC_RELAXED);
-		atomic_add(counters.ns_total,     total * 1e6,     ATOMIC_RELAXED);
-		atomic_add(counters.ns_exclusive, exclusive * 1e6, ATOMIC_RELAXED);
-	} catch(...){
+boost::uint64_t ProfileDepository::get_ticks() NOEXCEPT {
+#ifdef __x86_64__
+	if(atomic_load(g_use_tsc, ATOMIC_RELAXED)){
+		return read_tsc();
+	}
+#endif
+	return read_monotonic_ns();
+}
+boost::uint64_t ProfileDepository::get_ticks(bool &uses_tsc) NOEXCEPT {
+#ifdef __x86_64__
+	if(atomic_load(g_use_tsc, ATOMIC_RELAXED)){
+		uses_tsc = true;
+		return read_tsc();
+	}
+#endif
+	uses_tsc = false;
+	return read_monotonic_ns();
+}
+
+void ProfileDepository::accumulate(Profiler::CallSite &site, boost::uint64_t ticks_total, boost::uint64_t ticks_exclusive) NOEXCEPT {
+	AUTO(index, atomic_load(site.index, ATOMIC_RELAXED));
+	if(index == 0){
+		index = register_site(site);
+	}
+	if((index == 0) || (index == INDEX_EXHAUSTED)){
+		return;
+	}
+	const AUTO(counters, get_counters(index - 1));
+	if(!counters){
+		return;
+	}
+	const AUTO(ns_total, ticks_to_ns(ticks_total));
+	const AUTO(ns_exclusive, ticks_to_ns(ticks_exclusive));
+	// 只有当前线程写入，不需要原子的读-改-写操作。
+	atomic_store(counters->samples,      atomic_load(counters->samples, ATOMIC_RELAXED) + 1,                ATOMIC_RELAXED);
+	atomic_store(counters->ns_total,     atomic_load(counters->ns_total, ATOMIC_RELAXED) + ns_total,         ATOMIC_RELAXED);
+	atomic_store(counters->ns_exclusive, atomic_load(counters->ns_exclusive, ATOMIC_RELAXED) + ns_exclusive, ATOMIC_RELAXED);
+}
+
+void ProfileDepository::record_latency(Profiler::CallSite &site, boost::uint64_t ticks) NOEXCEPT {
+	const AUTO(index, atomic_load(site.index, ATOMIC_RELAXED));
+	if((index == 0) || (index == INDEX_EXHAUSTED)){
+		return;
+	}
+	const AUTO(counters, get_counters(index - 1));
+	if(!counters){
+		return;
+	}
+	AUTO(latency, counters->latency);
+	if(!latency){
+		latency = new(std::nothrow) LatencyHistogram;
+		if(!latency){
+			return;
+		}
+		latency->epoch = 0;
+		atomic_store(counters->latency, latency, ATOMIC_RELEASE);
+	}
+	const AUTO(epoch, atomic_load(g_latency_epoch, ATOMIC_RELAXED));
+	if(latency->epoch != epoch){
+		// 已经被重置过，先清空再开始新的纪元。
+		atomic_store(latency->epoch, 0, ATOMIC_RELEASE);
+		for(std::size_t i = 0; i < LATENCY_BUCKET_COUNT; ++i){
+			atomic_store(latency->counts[i], 0, ATOMIC_RELAXED);
+		}
+		atomic_store(latency->max, 0, ATOMIC_RELAXED);
+		atomic_store(latency->epoch, epoch, ATOMIC_RELEASE);
+	}
+	const AUTO(ns, ticks_to_ns(ticks));
+	AUTO_REF(count, latency->counts[get_latency_bucket(ns)]);
+	atomic_store(count, atomic_load(count, ATOMIC_RELAXED) + 1, ATOMIC_RELAXED);
+	if(atomic_load(latency->max, ATOMIC_RELAXED) < ns){
+		atomic_store(latency->max, ns, ATOMIC_RELAXED);
+	}
+}
+
+void ProfileDepository::reset_latency() NOEXCEPT {
+	const Mutex::UniqueLock lock(g_mutex);
+	atomic_add(g_latency_epoch, 1, ATOMIC_RELAXED);
+	for(AUTO(it, g_retired.begin()); it != g_retired.end(); ++it){
+		it->clear_latency();
 	}
 }
 
 std::vector<ProfileDepository::SnapshotElement> ProfileDepository::snapshot(){
 	Profiler::accumulate_all_in_thread();
 
-	std::vector<SnapshotElement> ret;
+	std::vector<SiteTotals> sites;
 	{
 		const Mutex::UniqueLock lock(g_mutex);
-		ret.reserve(g_profile.size());
-		for(AUTO(it, g_profile.begin()); it != g_profile.end(); ++it){
-			const AUTO_REF(key, it->first);
-			const AUTO_REF(counters, it->second);
-			SnapshotElement elem;
-			elem.file         = key.file;
-			elem.line         = key.line;
-			elem.func         = key.func;
-			elem.samples      = atomic_load(counters.samples, ATOMIC_RELAXED);
-			elem.ns_total     = atomic_load(counters.ns_total, ATOMIC_RELAXED);
-			elem.ns_exclusive = atomic_load(counters.ns_exclusive, ATOMIC_RELAXED);
-			ret.push_back(elem);
+		std::vector<ProfileTotals> totals(g_retired);
+		totals.resize(g_sites.size());
+		const AUTO(epoch, atomic_load(g_latency_epoch, ATOMIC_RELAXED));
+		for(AUTO(thread, g_threads); thread; thread = thread->next){
+			for(std::size_t slot = 0; slot < g_sites.size(); ++slot){
+				const AUTO(chunk, atomic_load(thread->chunks[slot / COUNTERS_PER_CHUNK], ATOMIC_ACQUIRE));
+				if(!chunk){
+					slot |= COUNTERS_PER_CHUNK - 1;
+					continue;
+				}
+				totals.at(slot).add(chunk[slot % COUNTERS_PER_CHUNK], epoch);
+			}
+		}
+		sites.reserve(g_sites.size());
+		for(std::size_t slot = 0; slot < g_sites.size(); ++slot){
+			if(totals.at(slot).samples == 0){
+				continue;
+			}
+			const AUTO(site, g_sites.at(slot));
+			sites.push_back(SiteTotals(ProfileKey(site->file, site->line, site->func), totals.at(slot)));
+		}
+	}
+	// 同一个头文件中的调用点在不同的翻译单元中各有一个静态对象，在这里合并。
+	std::sort(sites.begin(), sites.end());
+
+	std::vector<SiteTotals> merged;
+	merged.reserve(sites.size());
+	for(AUTO(it, sites.begin()); it != sites.end(); ++it){
+		if(!merged.empty() && !(merged.back() < *it)){
+			merged.back().totals.add(it->totals);
+			continue;
+		}
+		merged.push_back(*it);
+	}
+
+	std::vector<SnapshotElement> ret;
+	ret.reserve(merged.size());
+	for(AUTO(it, merged.begin()); it != merged.end(); ++it){
+		const AUTO_REF(totals, it->totals);
+		boost::uint64_t latency_samples = 0;
+		for(std::size_t i = 0; i < totals.latency_counts.size(); ++i){
+			latency_samples += totals.latency_counts[i];
 		}
+		SnapshotElement elem;
+		elem.file            = it->key.file;
+		elem.line            = it->key.line;
+		elem.func            = it->key.func;
+		elem.samples         = totals.samples;
+		elem.ns_total        = totals.ns_total;
+		elem.ns_exclusive    = totals.ns_exclusive;
+		elem.latency_samples = latency_samples;
+		elem.ns_p50          = get_latency_percentile(totals, latency_samples, 0.50);
+		elem.ns_p90          = get_latency_percentile(totals, latency_samples, 0.90);
+		elem.ns_p99          = get_latency_percentile(totals, latency_samples, 0.99);
+		elem.ns_p999         = get_latency_percentile(totals, latency_samples, 0.999);
+		elem.ns_max          = totals.latency_max;
+		ret.push_back(elem);
 	}
 	return ret;
 }
@@ -5,7 +5,9 @@
 #define POSEIDON_PROFILE_DEPOSITORY_HPP_
 
 #include "../cxx_ver.hpp"
+#include "../profiler.hpp"
 #include <vector>
+#include <boost/cstdint.hpp>
 
 namespace Poseidon {
 
@@ -21,14 +23,29 @@ struct ProfileDepository {
 		unsigned long long ns_total;
 		// ns_total 扣除执行点位于其他 profiler 之中的纳秒数。
 		unsigned long long ns_exclusive;
+
+		// 以下是从上次调用 reset_latency() 开始，每次完整执行（包括纤程让出的时间）的纳秒数的分布。
+		unsigned long long latency_samples;
+		unsigned long long ns_p50;
+		unsigned long long ns_p90;
+		unsigned long long ns_p99;
+		unsigned long long ns_p999;
+		unsigned long long ns_max;
 	};
 
 	static void start();
 	static void stop();
 
 	static bool is_enabled();
-	static void accumulate(const char *file, unsigned long line, const char *func,
-		double total, double exclusive) NOEXCEPT;
+	// 返回值的单位取决于计时方式（纳秒或者 TSC 周期），只能用于计算差值。
+	static boost::uint64_t get_ticks() NOEXCEPT;
+	// 同上，并且返回读取时使用的计时方式。两种计时方式的值不能相减。
+	static boost::uint64_t get_ticks(bool &uses_tsc) NOEXCEPT;
+	// 只写入当前线程的计数器，不加锁。
+	static void accumulate(Profiler::CallSite &site, boost::uint64_t ticks_total, boost::uint64_t ticks_exclusive) NOEXCEPT;
+	// 在 profiler 析构时调用，记录从构造到析构的时间。
+	static void record_latency(Profiler::CallSite &site, boost::uint64_t ticks) NOEXCEPT;
+	static void reset_latency() NOEXCEPT;
 
 	static std::vector<SnapshotElement> snapshot();
 
@@ -130,6 +130,37 @@ namespace {
 						contents.put(temp, len);
 					}
 
+					send(Http::ST_OK, STD_MOVE(headers), STD_MOVE(contents));
+				} else if(uri == "show_profile_latency"){
+					OptionalMap headers;
+					headers.set(sslit("Content-Type"), "text/csv; charset=utf-8");
+					headers.set(sslit("Content-Disposition"), "attachment; name=\"profile_latency.csv\"");
+
+					StreamBuffer contents;
+					contents.put("file,line,func,samples,ns_p50,ns_p90,ns_p99,ns_p999,ns_max\r\n");
+					AUTO(snapshot, ProfileDepository::snapshot());
+					// 如果指定了 reset=1，输出之后开始新的统计窗口。
+					const AUTO_REF(reset_str, request_headers.get_params.get("reset"));
+					if(!reset_str.empty() && (reset_str != "0")){
+						ProfileDepository::reset_latency();
+					}
+					std::string str;
+					for(AUTO(it, snapshot.begin()); it != snapshot.end(); ++it){
+						if(it->latency_samples == 0){
+							continue;
+						}
+						escape_csv_field(str, it->file);
+						contents.put(str);
+						char temp[256];
+						unsigned len = (unsigned)std::sprintf(temp, ",%llu,", (unsigned long long)it->line);
+						contents.put(temp, len);
+						escape_csv_field(str, it->func);
+						contents.put(str);
+						len = (unsigned)std::sprintf(temp, ",%llu,%llu,%llu,%llu,%llu,%llu\r\n",
+							it->latency_samples, it->ns_p50, it->ns_p90, it->ns_p99, it->ns_p999, it->ns_max);
+						contents.put(temp, len);
+					}
+
 					send(Http::ST_OK, STD_MOVE(headers), STD_MOVE(contents));
 				} else if(uri == "show_modules"){
 					OptionalMap headers;
@@ -170,6 +201,22 @@ namespace {
 						contents.put(temp, len);
 					}
 
+					send(Http::ST_OK, STD_MOVE(headers), STD_MOVE(contents));
+				} else if(uri == "show_memory"){
+					OptionalMap headers;
+					headers.set(sslit("Content-Type"), "text/csv; charset=utf-8");
+					headers.set(sslit("Content-Disposition"), "attachment; name=\"memory.csv\"");
+
+					StreamBuffer contents;
+					contents.put("name,bytes\r\n");
+					char temp[256];
+					unsigned len = (unsigned)std::sprintf(temp, "stream_buffer_allocated,%llu\r\n",
+						(unsigned long long)StreamBuffer::get_allocated_bytes());
+					contents.put(temp, len);
+					len = (unsigned)std::sprintf(temp, "stream_buffer_pooled,%llu\r\n",
+						(unsigned long long)StreamBuffer::get_pooled_bytes());
+					contents.put(temp, len);
+
 					send(Http::ST_OK, STD_MOVE(headers), STD_MOVE(contents));
 				} else if(uri == "set_log_mask"){
 					unsigned long long to_enable = 0, to_disable = 0;
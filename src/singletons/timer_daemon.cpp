@@ -4,32 +4,52 @@
 #include "../precompiled.hpp"
 #include "timer_daemon.hpp"
 #include "job_dispatcher.hpp"
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
 #include "../thread.hpp"
 #include "../log.hpp"
 #include "../atomic.hpp"
 #include "../exception.hpp"
 #include "../mutex.hpp"
-#include "../condition_variable.hpp"
+#include "../raii.hpp"
+#include "../system_exception.hpp"
 #include "../time.hpp"
 #include "../job_base.hpp"
 #include "../profiler.hpp"
 
 namespace Poseidon {
 
+struct TimerItem;
+
+namespace {
+	struct TimerList {
+		TimerItem *head;
+		TimerItem *tail;
+	};
+}
+
 struct TimerItem : NONCOPYABLE {
 	boost::uint64_t period;
 	boost::shared_ptr<const TimerCallback> callback;
 	bool is_async;
-	unsigned long stamp;
+
+	// 以下成员由 g_mutex 保护。
+	boost::weak_ptr<TimerItem> weak_self;
+	boost::uint64_t next;
+	TimerList *list;
+	TimerItem *prev_in_list;
+	TimerItem *next_in_list;
 
 	TimerItem(boost::uint64_t period_, boost::shared_ptr<const TimerCallback> callback_, bool is_async_)
-		: period(period_), callback(STD_MOVE(callback_)), is_async(is_async_), stamp(0)
+		: period(period_), callback(STD_MOVE(callback_)), is_async(is_async_)
+		, weak_self(), next(0), list(NULLPTR), prev_in_list(NULLPTR), next_in_list(NULLPTR)
 	{
 		LOG_POSEIDON_DEBUG("Created timer: period = ", period, ", is_async = ", is_async);
 	}
-	~TimerItem(){
-		LOG_POSEIDON_DEBUG("Destroyed timer: period = ", period, ", is_async = ", is_async);
-	}
+	~TimerItem();
 };
 
 namespace {
@@ -60,27 +80,235 @@ namespace {
 		}
 	};
 
-	struct TimerQueueElement {
-		boost::uint64_t next;
-		boost::weak_ptr<TimerItem> item;
-		unsigned long stamp;
-
-		TimerQueueElement(boost::uint64_t next_, boost::weak_ptr<TimerItem> item_, unsigned long stamp_)
-			: next(next_), item(STD_MOVE(item_)), stamp(stamp_)
-		{
-		}
-
-		bool operator<(const TimerQueueElement &rhs) const {
-			return next > rhs.next;
-		}
+	// 分层时间轮，精度为 1 毫秒。第零层有 256 个槽，之后每层 64 个槽，一共覆盖 2^32 毫秒（大约 49 天），
+	// 更远的计时器放在溢出链表中，每当最高层转完一圈时重新安排。插入、删除和重新设定时间都是 O(1) 的。
+	enum {
+		WHEEL0_BITS     = 8,
+		WHEEL_BITS      = 6,
+		WHEEL_LEVELS    = 4,
+
+		WHEEL0_SIZE     = 1u << WHEEL0_BITS,
+		WHEEL_SIZE      = 1u << WHEEL_BITS,
+		WHEEL0_MASK     = WHEEL0_SIZE - 1,
+		WHEEL_MASK      = WHEEL_SIZE - 1,
 	};
 
 	volatile bool g_running = false;
 	Thread g_thread;
 
 	Mutex g_mutex;
-	ConditionVariable g_new_timer;
-	std::vector<TimerQueueElement> g_timers;
+	// 计时器线程在 timerfd 上等待下一个到期时刻，其他线程通过 eventfd 唤醒它。
+	UniqueFile g_timer_fd;
+	UniqueFile g_wake_fd;
+
+	// 下一个还没有处理的时刻。
+	boost::uint64_t g_wheel_time = 0;
+	TimerList g_wheel0[WHEEL0_SIZE];
+	TimerList g_wheels[WHEEL_LEVELS][WHEEL_SIZE];
+	TimerList g_overflow;
+	// 已经到期但是还没有触发的计时器。
+	TimerList g_expired;
+	// 不包括 g_expired 中的计时器。
+	std::size_t g_timer_count = 0;
+	std::size_t g_wheel0_count = 0;
+	// 计时器线程计划醒来的时刻。早于这个时刻的计时器需要唤醒它。
+	boost::uint64_t g_next_wake_time = 0;
+
+	void link_timer(TimerList &list, TimerItem *item) NOEXCEPT {
+		assert(!item->list);
+
+		item->list = &list;
+		item->prev_in_list = list.tail;
+		item->next_in_list = NULLPTR;
+		if(list.tail){
+			list.tail->next_in_list = item;
+		} else {
+			list.head = item;
+		}
+		list.tail = item;
+
+		if(&list != &g_expired){
+			++g_timer_count;
+		}
+		if((&list >= g_wheel0) && (&list < g_wheel0 + WHEEL0_SIZE)){
+			++g_wheel0_count;
+		}
+	}
+	void unlink_timer(TimerItem *item) NOEXCEPT {
+		const AUTO(list, item->list);
+		if(!list){
+			return;
+		}
+
+		if(item->prev_in_list){
+			item->prev_in_list->next_in_list = item->next_in_list;
+		} else {
+			list->head = item->next_in_list;
+		}
+		if(item->next_in_list){
+			item->next_in_list->prev_in_list = item->prev_in_list;
+		} else {
+			list->tail = item->prev_in_list;
+		}
+		item->list = NULLPTR;
+		item->prev_in_list = NULLPTR;
+		item->next_in_list = NULLPTR;
+
+		if(list != &g_expired){
+			--g_timer_count;
+		}
+		if((list >= g_wheel0) && (list < g_wheel0 + WHEEL0_SIZE)){
+			--g_wheel0_count;
+		}
+	}
+	TimerList detach_list(TimerList &list) NOEXCEPT {
+		const TimerList ret = list;
+		for(AUTO(item, ret.head); item; item = item->next_in_list){
+			item->list = NULLPTR;
+
+			--g_timer_count;
+			if((&list >= g_wheel0) && (&list < g_wheel0 + WHEEL0_SIZE)){
+				--g_wheel0_count;
+			}
+		}
+		list.head = NULLPTR;
+		list.tail = NULLPTR;
+		return ret;
+	}
+
+	void schedule_timer(TimerItem *item) NOEXCEPT {
+		assert(!item->list);
+
+		const AUTO(next, item->next);
+		if(next < g_wheel_time){
+			link_timer(g_wheel0[g_wheel_time & WHEEL0_MASK], item);
+			return;
+		}
+		const AUTO(delta, next - g_wheel_time);
+		if(delta < WHEEL0_SIZE){
+			link_timer(g_wheel0[next & WHEEL0_MASK], item);
+			return;
+		}
+		for(unsigned level = 0; level < WHEEL_LEVELS; ++level){
+			const unsigned shift = WHEEL0_BITS + WHEEL_BITS * level;
+			if(delta < (boost::uint64_t)1 << (shift + WHEEL_BITS)){
+				link_timer(g_wheels[level][(next >> shift) & WHEEL_MASK], item);
+				return;
+			}
+		}
+		link_timer(g_overflow, item);
+	}
+	void reschedule_list(TimerList &list) NOEXCEPT {
+		const AUTO(detached, detach_list(list));
+		AUTO(item, detached.head);
+		while(item){
+			const AUTO(next_item, item->next_in_list);
+			item->prev_in_list = NULLPTR;
+			item->next_in_list = NULLPTR;
+			schedule_timer(item);
+			item = next_item;
+		}
+	}
+	void splice_expired(TimerList &list) NOEXCEPT {
+		const AUTO(detached, detach_list(list));
+		if(!detached.head){
+			return;
+		}
+		for(AUTO(item, detached.head); item; item = item->next_in_list){
+			item->list = &g_expired;
+		}
+		detached.head->prev_in_list = g_expired.tail;
+		if(g_expired.tail){
+			g_expired.tail->next_in_list = detached.head;
+		} else {
+			g_expired.head = detached.head;
+		}
+		g_expired.tail = detached.tail;
+	}
+
+	// 把所有不晚于 now 的计时器移到 g_expired 中。
+	void advance_wheel(boost::uint64_t now) NOEXCEPT {
+		while(g_wheel_time <= now){
+			if(g_timer_count == 0){
+				g_wheel_time = now + 1;
+				break;
+			}
+			const unsigned index = g_wheel_time & WHEEL0_MASK;
+			if(index == 0){
+				// 逐层把上一层的槽展开到下一层。
+				unsigned level = 0;
+				for(;;){
+					const unsigned shift = WHEEL0_BITS + WHEEL_BITS * level;
+					const unsigned cascade_index = (g_wheel_time >> shift) & WHEEL_MASK;
+					reschedule_list(g_wheels[level][cascade_index]);
+					if(cascade_index != 0){
+						break;
+					}
+					if(++level == WHEEL_LEVELS){
+						reschedule_list(g_overflow);
+						break;
+					}
+				}
+			}
+			if(g_wheel0_count == 0){
+				// 第零层是空的，直接跳到下一次展开的时刻。
+				const AUTO(next_cascade_time, (g_wheel_time | WHEEL0_MASK) + 1);
+				g_wheel_time = std::min<boost::uint64_t>(next_cascade_time, now + 1);
+				continue;
+			}
+			splice_expired(g_wheel0[index]);
+			++g_wheel_time;
+		}
+	}
+	boost::uint64_t get_next_wake_time() NOEXCEPT {
+		if(g_expired.head){
+			return g_wheel_time;
+		}
+		const AUTO(next_cascade_time, (g_wheel_time | WHEEL0_MASK) + 1);
+		if(g_wheel0_count != 0){
+			for(AUTO(time, g_wheel_time); time < next_cascade_time; ++time){
+				if(g_wheel0[time & WHEEL0_MASK].head){
+					return time;
+				}
+			}
+		}
+		return next_cascade_time;
+	}
+
+	void wake_daemon() NOEXCEPT {
+		if(!g_wake_fd){
+			return;
+		}
+		const boost::uint64_t one = 1;
+		if(::write(g_wake_fd.get(), &one, sizeof(one)) < 0){
+			const int err_code = errno;
+			if(err_code != EAGAIN){
+				LOG_POSEIDON_ERROR("Failed to write to eventfd: err_code = ", err_code);
+			}
+		}
+	}
+	void drain_fd(int fd) NOEXCEPT {
+		boost::uint64_t value;
+		if(::read(fd, &value, sizeof(value)) < 0){
+			const int err_code = errno;
+			if(err_code != EAGAIN){
+				LOG_POSEIDON_ERROR("Failed to read from timerfd or eventfd: err_code = ", err_code);
+			}
+		}
+	}
+
+	// 调用之前必须锁定 g_mutex。
+	void arm_timer(TimerItem *item, boost::uint64_t time_point) NOEXCEPT {
+		if(g_wheel_time == 0){
+			g_wheel_time = get_fast_mono_clock();
+		}
+		unlink_timer(item);
+		item->next = time_point;
+		schedule_timer(item);
+		if(time_point < g_next_wake_time){
+			wake_daemon();
+		}
+	}
 
 	bool pump_one_element() NOEXCEPT {
 		PROFILE_ME;
@@ -90,22 +318,20 @@ namespace {
 		boost::shared_ptr<TimerItem> item;
 		{
 			const Mutex::UniqueLock lock(g_mutex);
-			while(!g_timers.empty() && (now >= g_timers.front().next)){
-				item = g_timers.front().item.lock();
-				const AUTO(stamp, g_timers.front().stamp);
-				std::pop_heap(g_timers.begin(), g_timers.end());
-
-				if(item && (stamp == item->stamp)){
-					if(item->period == 0){
-						g_timers.pop_back();
-					} else {
-						g_timers.back().next += item->period;
-						std::push_heap(g_timers.begin(), g_timers.end());
-					}
-					break;
+			advance_wheel(now);
+			while(g_expired.head){
+				const AUTO(cur, g_expired.head);
+				unlink_timer(cur);
+				// 如果计时器正在被析构，它的析构函数在等待 g_mutex，这里直接跳过。
+				item = cur->weak_self.lock();
+				if(!item){
+					continue;
+				}
+				if(item->period != 0){
+					item->next += item->period;
+					schedule_timer(item.get());
 				}
-				item.reset();
-				g_timers.pop_back();
+				break;
 			}
 		}
 		if(!item){
@@ -141,8 +367,41 @@ namespace {
 				break;
 			}
 
-			Mutex::UniqueLock lock(g_mutex);
-			g_new_timer.timed_wait(lock, 100);
+			{
+				const Mutex::UniqueLock lock(g_mutex);
+				g_next_wake_time = get_next_wake_time();
+				if(g_next_wake_time <= get_fast_mono_clock()){
+					continue;
+				}
+				// 使用绝对时间，与 get_fast_mono_clock() 使用同一个时钟。
+				::itimerspec its = { };
+				its.it_value.tv_sec = static_cast< ::time_t>(g_next_wake_time / 1000);
+				its.it_value.tv_nsec = static_cast<long>(g_next_wake_time % 1000 * 1000000);
+				if(::timerfd_settime(g_timer_fd.get(), TFD_TIMER_ABSTIME, &its, NULLPTR) != 0){
+					const int err_code = errno;
+					LOG_POSEIDON_FATAL("::timerfd_settime() failed: err_code = ", err_code);
+					std::abort();
+				}
+			}
+
+			::pollfd fds[2];
+			fds[0].fd = g_timer_fd.get();
+			fds[0].events = POLLIN;
+			fds[1].fd = g_wake_fd.get();
+			fds[1].events = POLLIN;
+			if(::poll(fds, 2, -1) < 0){
+				const int err_code = errno;
+				if(err_code != EINTR){
+					LOG_POSEIDON_ERROR("::poll() failed: err_code = ", err_code);
+				}
+				continue;
+			}
+			if(fds[0].revents & POLLIN){
+				drain_fd(fds[0].fd);
+			}
+			if(fds[1].revents & POLLIN){
+				drain_fd(fds[1].fd);
+			}
 		}
 	}
 
@@ -156,6 +415,13 @@ namespace {
 	}
 }
 
+TimerItem::~TimerItem(){
+	LOG_POSEIDON_DEBUG("Destroyed timer: period = ", period, ", is_async = ", is_async);
+
+	const Mutex::UniqueLock lock(g_mutex);
+	unlink_timer(this);
+}
+
 void TimerDaemon::start(){
 	if(atomic_exchange(g_running, true, ATOMIC_ACQ_REL) != false){
 		LOG_POSEIDON_FATAL("Only one daemon is allowed at the same time.");
@@ -163,6 +429,22 @@ void TimerDaemon::start(){
 	}
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Starting timer daemon...");
 
+	{
+		const Mutex::UniqueLock lock(g_mutex);
+		if(g_wheel_time == 0){
+			g_wheel_time = get_fast_mono_clock();
+		}
+		if(!g_timer_fd.reset(::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))){
+			const int err_code = errno;
+			LOG_POSEIDON_FATAL("::timerfd_create() failed: err_code = ", err_code);
+			DEBUG_THROW(SystemException, err_code);
+		}
+		if(!g_wake_fd.reset(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))){
+			const int err_code = errno;
+			LOG_POSEIDON_FATAL("::eventfd() failed: err_code = ", err_code);
+			DEBUG_THROW(SystemException, err_code);
+		}
+	}
 	Thread(thread_proc, "  T ").swap(g_thread);
 }
 void TimerDaemon::stop(){
@@ -171,10 +453,29 @@ void TimerDaemon::stop(){
 	}
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping timer daemon...");
 
+	{
+		const Mutex::UniqueLock lock(g_mutex);
+		wake_daemon();
+	}
 	if(g_thread.joinable()){
 		g_thread.join();
 	}
-	g_timers.clear();
+
+	const Mutex::UniqueLock lock(g_mutex);
+	g_timer_fd.reset();
+	g_wake_fd.reset();
+	for(unsigned index = 0; index < WHEEL0_SIZE; ++index){
+		detach_list(g_wheel0[index]);
+	}
+	for(unsigned level = 0; level < WHEEL_LEVELS; ++level){
+		for(unsigned index = 0; index < WHEEL_SIZE; ++index){
+			detach_list(g_wheels[level][index]);
+		}
+	}
+	detach_list(g_overflow);
+	while(g_expired.head){
+		unlink_timer(g_expired.head);
+	}
 }
 
 boost::shared_ptr<TimerItem> TimerDaemon::register_absolute_timer(
@@ -185,9 +486,8 @@ boost::shared_ptr<TimerItem> TimerDaemon::register_absolute_timer(
 	AUTO(item, boost::make_shared<TimerItem>(period, boost::make_shared<TimerCallback>(STD_MOVE_IDN(callback)), is_async));
 	{
 		const Mutex::UniqueLock lock(g_mutex);
-		g_timers.push_back(TimerQueueElement(time_point, item, item->stamp));
-		std::push_heap(g_timers.begin(), g_timers.end());
-		g_new_timer.signal();
+		item->weak_self = item;
+		arm_timer(item.get(), time_point);
 	}
 	LOG_POSEIDON_DEBUG("Created a(n) ", is_async ? "async " : "", "timer item which will be triggered ",
 		__extension__({ const AUTO(now, get_fast_mono_clock()); (time_point < now) ? 0 : (time_point - now); }),
@@ -230,9 +530,7 @@ void TimerDaemon::set_absolute_time(const boost::shared_ptr<TimerItem> &item, bo
 	if(period != TimerDaemon::PERIOD_NOT_MODIFIED){
 		item->period = period;
 	}
-	g_timers.push_back(TimerQueueElement(time_point, item, ++item->stamp));
-	std::push_heap(g_timers.begin(), g_timers.end());
-	g_new_timer.signal();
+	arm_timer(item.get(), time_point);
 }
 void TimerDaemon::set_time(const boost::shared_ptr<TimerItem> &item, boost::uint64_t first, boost::uint64_t period){
 	return set_absolute_time(item, get_fast_mono_clock() + first, period);
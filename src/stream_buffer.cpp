@@ -4,70 +4,291 @@
 #include "precompiled.hpp"
 #include "stream_buffer.hpp"
 #include "atomic.hpp"
+#include <sys/uio.h>
+#include <pthread.h>
+#include <cstdlib>
+#include <boost/static_assert.hpp>
 
 namespace Poseidon {
 
-struct StreamBuffer::Chunk FINAL {
-	static volatile bool s_pool_lock;
-	static Chunk *s_pool_head;
-
-	static void *operator new(std::size_t bytes){
-		assert(bytes == sizeof(Chunk));
+namespace {
+	enum {
+		CLASS_SMALL             = 0,
+		CLASS_LARGE             = 1,
+		CLASS_NODE              = 2,
+		CLASS_COUNT             = 3,
+
+		SMALL_CHUNK_CAPACITY    = 0x100,
+		LARGE_CHUNK_CAPACITY    = 0x4000,
+		// 一次需要的字节数不小于这个值时分配大块。
+		LARGE_CHUNK_THRESHOLD   = 0x2000,
+		NODE_BLOCK_SIZE         = 0x40,
+
+		// 每个线程每种大小最多缓存的块数，以及与全局池之间每次交换的块数。
+		THREAD_CACHE_MAX        = 64,
+		THREAD_CACHE_BATCH      = 32,
+		// 全局池中空闲内存的上限，超出的部分直接归还给系统。
+		MAX_POOLED_BYTES        = 0x4000000,
+	};
+
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+
+	struct BlockList {
+		FreeBlock *head;
+		std::size_t count;
+	};
+
+	// 数据存储块，可以被多个 StreamBuffer 的块共享。被共享的存储块是只读的。
+	struct Storage {
+		volatile std::size_t ref_count;
+		unsigned cls;
+		unsigned capacity;
+
+		// 数据紧跟在结构体之后。
+		unsigned char *data() NOEXCEPT {
+			return reinterpret_cast<unsigned char *>(this + 1);
+		}
+	};
+
+	volatile bool g_pool_lock = false;
+	BlockList g_pools[CLASS_COUNT];
+	volatile std::size_t g_pooled_bytes = 0;
+	volatile std::size_t g_allocated_bytes = 0;
+
+	__thread BlockList t_caches[CLASS_COUNT];
+	__thread bool t_cache_registered = false;
+
+	::pthread_once_t g_cache_key_once = PTHREAD_ONCE_INIT;
+	::pthread_key_t g_cache_key;
+
+	std::size_t get_block_size(unsigned cls) NOEXCEPT {
+		switch(cls){
+		case CLASS_SMALL:
+			return sizeof(Storage) + SMALL_CHUNK_CAPACITY;
+		case CLASS_LARGE:
+			return sizeof(Storage) + LARGE_CHUNK_CAPACITY;
+		default:
+			return NODE_BLOCK_SIZE;
+		}
+	}
 
-		while(atomic_exchange(s_pool_lock, true, ATOMIC_ACQ_REL) == true){
+	void lock_pool() NOEXCEPT {
+		while(atomic_exchange(g_pool_lock, true, ATOMIC_ACQ_REL) == true){
 			atomic_pause();
 		}
-		const AUTO(head, s_pool_head);
-		if(!head){
-			atomic_store(s_pool_lock, false, ATOMIC_RELEASE);
-			return ::operator new(bytes);
+	}
+	void unlock_pool() NOEXCEPT {
+		atomic_store(g_pool_lock, false, ATOMIC_RELEASE);
+	}
+
+	void release_to_pool(unsigned cls, BlockList &list, std::size_t count) NOEXCEPT {
+		const AUTO(block_size, get_block_size(cls));
+
+		FreeBlock *to_free = NULLPTR;
+		lock_pool();
+		while((count != 0) && list.head){
+			const AUTO(block, list.head);
+			list.head = block->next;
+			--list.count;
+			--count;
+
+			if(atomic_load(g_pooled_bytes, ATOMIC_RELAXED) + block_size > MAX_POOLED_BYTES){
+				block->next = to_free;
+				to_free = block;
+				continue;
+			}
+			block->next = g_pools[cls].head;
+			g_pools[cls].head = block;
+			++g_pools[cls].count;
+			atomic_add(g_pooled_bytes, block_size, ATOMIC_RELAXED);
+		}
+		unlock_pool();
+
+		while(to_free){
+			const AUTO(block, to_free);
+			to_free = block->next;
+			::operator delete(block);
+			atomic_sub(g_allocated_bytes, block_size, ATOMIC_RELAXED);
+		}
+	}
+
+	void thread_cache_destructor(void *) NOEXCEPT {
+		t_cache_registered = false;
+		for(unsigned cls = 0; cls < CLASS_COUNT; ++cls){
+			release_to_pool(cls, t_caches[cls], t_caches[cls].count);
+		}
+	}
+	void create_thread_cache_key() NOEXCEPT {
+		if(::pthread_key_create(&g_cache_key, &thread_cache_destructor) != 0){
+			std::abort();
 		}
-		s_pool_head = head->prev;
-		atomic_store(s_pool_lock, false, ATOMIC_RELEASE);
-		return head;
 	}
-	static void operator delete(void *p) NOEXCEPT {
-		if(!p){
+	void register_thread_cache() NOEXCEPT {
+		if(t_cache_registered){
 			return;
 		}
-		const AUTO(head, static_cast<Chunk *>(p));
+		::pthread_once(&g_cache_key_once, &create_thread_cache_key);
+		::pthread_setspecific(g_cache_key, t_caches);
+		t_cache_registered = true;
+	}
 
-		while(atomic_exchange(s_pool_lock, true, ATOMIC_ACQ_REL) == true){
-			atomic_pause();
+	void *allocate_block(unsigned cls){
+		const AUTO(block_size, get_block_size(cls));
+
+		register_thread_cache();
+
+		AUTO_REF(cache, t_caches[cls]);
+		if(!cache.head){
+			// 从全局池中批量取出。
+			lock_pool();
+			while((cache.count < THREAD_CACHE_BATCH) && g_pools[cls].head){
+				const AUTO(block, g_pools[cls].head);
+				g_pools[cls].head = block->next;
+				--g_pools[cls].count;
+				atomic_sub(g_pooled_bytes, block_size, ATOMIC_RELAXED);
+
+				block->next = cache.head;
+				cache.head = block;
+				++cache.count;
+			}
+			unlock_pool();
+		}
+		if(cache.head){
+			const AUTO(block, cache.head);
+			cache.head = block->next;
+			--cache.count;
+			return block;
+		}
+		void *const block = ::operator new(block_size);
+		atomic_add(g_allocated_bytes, block_size, ATOMIC_RELAXED);
+		return block;
+	}
+	void deallocate_block(unsigned cls, void *p) NOEXCEPT {
+		const AUTO(block, static_cast<FreeBlock *>(p));
+
+		register_thread_cache();
+
+		AUTO_REF(cache, t_caches[cls]);
+		block->next = cache.head;
+		cache.head = block;
+		++cache.count;
+		if(cache.count > THREAD_CACHE_MAX){
+			release_to_pool(cls, cache, THREAD_CACHE_BATCH);
+		}
+	}
+
+	Storage *create_storage(unsigned cls){
+		const AUTO(storage, static_cast<Storage *>(allocate_block(cls)));
+		storage->ref_count = 1;
+		storage->cls = cls;
+		storage->capacity = static_cast<unsigned>(get_block_size(cls) - sizeof(Storage));
+		return storage;
+	}
+	void add_storage_ref(Storage *storage) NOEXCEPT {
+		atomic_add(storage->ref_count, 1, ATOMIC_RELAXED);
+	}
+	void drop_storage_ref(Storage *storage) NOEXCEPT {
+		if(atomic_sub(storage->ref_count, 1, ATOMIC_ACQ_REL) == 0){
+			deallocate_block(storage->cls, storage);
 		}
-		head->prev = s_pool_head;
-		s_pool_head = head;
-		atomic_store(s_pool_lock, false, ATOMIC_RELEASE);
+	}
+
+	unsigned get_class_for(std::size_t bytes_hint) NOEXCEPT {
+		return (bytes_hint >= LARGE_CHUNK_THRESHOLD) ? CLASS_LARGE : CLASS_SMALL;
 	}
 
 	__attribute__((__destructor__(101)))
-	static void pool_destructor() NOEXCEPT {
-		while(s_pool_head){
-			const AUTO(head, s_pool_head);
-			s_pool_head = head->prev;
-			::operator delete(head);
+	void pool_destructor() NOEXCEPT {
+		for(unsigned cls = 0; cls < CLASS_COUNT; ++cls){
+			while(g_pools[cls].head){
+				const AUTO(block, g_pools[cls].head);
+				g_pools[cls].head = block->next;
+				::operator delete(block);
+			}
+			g_pools[cls].count = 0;
+		}
+	}
+}
+
+struct StreamBuffer::Chunk FINAL {
+	static Chunk *create(unsigned cls){
+		BOOST_STATIC_ASSERT(sizeof(Chunk) <= NODE_BLOCK_SIZE);
+
+		const AUTO(storage, create_storage(cls));
+		void *block;
+		try {
+			block = allocate_block(CLASS_NODE);
+		} catch(...){
+			drop_storage_ref(storage);
+			throw;
 		}
+		const AUTO(chunk, static_cast<Chunk *>(block));
+		chunk->storage = storage;
+		return chunk;
+	}
+	// 新块与 src 共享存储，初始范围与 src 相同。
+	static Chunk *create_shared(const Chunk *src){
+		const AUTO(chunk, static_cast<Chunk *>(allocate_block(CLASS_NODE)));
+		add_storage_ref(src->storage);
+		chunk->storage = src->storage;
+		chunk->begin = src->begin;
+		chunk->end = src->end;
+		return chunk;
+	}
+	static void destroy(Chunk *chunk) NOEXCEPT {
+		drop_storage_ref(chunk->storage);
+		deallocate_block(CLASS_NODE, chunk);
 	}
 
 	Chunk *prev;
 	Chunk *next;
 	unsigned begin;
 	unsigned end;
-	unsigned char data[0x100];
+	Storage *storage;
+
+	unsigned char *data() const NOEXCEPT {
+		return storage->data();
+	}
+	unsigned capacity() const NOEXCEPT {
+		return storage->capacity;
+	}
+	bool is_shared() const NOEXCEPT {
+		return atomic_load(storage->ref_count, ATOMIC_CONSUME) != 1;
+	}
+	// 只有独占的存储块才可以写入 [begin, end) 以外的部分。
+	std::size_t get_head_avail() const NOEXCEPT {
+		return is_shared() ? 0 : begin;
+	}
+	std::size_t get_tail_avail() const NOEXCEPT {
+		return is_shared() ? 0 : capacity() - end;
+	}
 };
 
-volatile bool StreamBuffer::Chunk::s_pool_lock = false;
-StreamBuffer::Chunk *StreamBuffer::Chunk::s_pool_head = NULLPTR;
+std::size_t StreamBuffer::get_allocated_bytes() NOEXCEPT {
+	return atomic_load(g_allocated_bytes, ATOMIC_RELAXED);
+}
+std::size_t StreamBuffer::get_pooled_bytes() NOEXCEPT {
+	return atomic_load(g_pooled_bytes, ATOMIC_RELAXED);
+}
+
+StreamBuffer::ChunkEnumerator::ChunkEnumerator(StreamBuffer &rhs)
+	: m_chunk(NULLPTR)
+{
+	rhs.unshare();
+	m_chunk = rhs.m_first;
+}
 
 unsigned char *StreamBuffer::ChunkEnumerator::begin() const NOEXCEPT {
 	assert(m_chunk);
 
-	return m_chunk->data + m_chunk->begin;
+	return m_chunk->data() + m_chunk->begin;
 }
 unsigned char *StreamBuffer::ChunkEnumerator::end() const NOEXCEPT {
 	assert(m_chunk);
 
-	return m_chunk->data + m_chunk->end;
+	return m_chunk->data() + m_chunk->end;
 }
 
 StreamBuffer::ChunkEnumerator &StreamBuffer::ChunkEnumerator::operator++() NOEXCEPT {
@@ -80,12 +301,12 @@ StreamBuffer::ChunkEnumerator &StreamBuffer::ChunkEnumerator::operator++() NOEXC
 const unsigned char *StreamBuffer::ConstChunkEnumerator::begin() const NOEXCEPT {
 	assert(m_chunk);
 
-	return m_chunk->data + m_chunk->begin;
+	return m_chunk->data() + m_chunk->begin;
 }
 const unsigned char *StreamBuffer::ConstChunkEnumerator::end() const NOEXCEPT {
 	assert(m_chunk);
 
-	return m_chunk->data + m_chunk->end;
+	return m_chunk->data() + m_chunk->end;
 }
 
 StreamBuffer::ConstChunkEnumerator &StreamBuffer::ConstChunkEnumerator::operator++() NOEXCEPT {
@@ -114,9 +335,21 @@ StreamBuffer::StreamBuffer(const std::string &str)
 StreamBuffer::StreamBuffer(const StreamBuffer &rhs)
 	: m_first(NULLPTR), m_last(NULLPTR), m_size(0)
 {
-	for(AUTO(ce, rhs.get_chunk_enumerator()); ce; ++ce){
-		put(ce.data(), ce.size());
+	// 只复制块，存储块是共享的。
+	StreamBuffer temp;
+	for(AUTO(src, rhs.m_first); src; src = src->next){
+		const AUTO(chunk, Chunk::create_shared(src));
+		chunk->next = NULLPTR;
+		chunk->prev = temp.m_last;
+		if(temp.m_last){
+			temp.m_last->next = chunk;
+		} else {
+			temp.m_first = chunk;
+		}
+		temp.m_last = chunk;
 	}
+	temp.m_size = rhs.m_size;
+	swap(temp);
 }
 StreamBuffer &StreamBuffer::operator=(const StreamBuffer &rhs){
 	StreamBuffer(rhs).swap(*this);
@@ -147,7 +380,7 @@ int StreamBuffer::front() const NOEXCEPT {
 	AUTO(chunk, m_first);
 	do {
 		if(chunk->end != chunk->begin){
-			ret = chunk->data[chunk->begin];
+			ret = chunk->data()[chunk->begin];
 		}
 		chunk = chunk->next;
 	} while(ret < 0);
@@ -162,7 +395,7 @@ int StreamBuffer::back() const NOEXCEPT {
 	AUTO(chunk, m_last);
 	do {
 		if(chunk->end != chunk->begin){
-			ret = chunk->data[chunk->end - 1];
+			ret = chunk->data()[chunk->end - 1];
 		}
 		chunk = chunk->prev;
 	} while(ret < 0);
@@ -173,7 +406,7 @@ void StreamBuffer::clear() NOEXCEPT {
 	while(m_first){
 		const AUTO(chunk, m_first);
 		m_first = chunk->next;
-		delete chunk;
+		Chunk::destroy(chunk);
 	}
 	m_last = NULLPTR;
 	m_size = 0;
@@ -188,12 +421,12 @@ int StreamBuffer::get() NOEXCEPT {
 	AUTO(chunk, m_first);
 	do {
 		if(chunk->end != chunk->begin){
-			ret = chunk->data[chunk->begin];
+			ret = chunk->data()[chunk->begin];
 			++(chunk->begin);
 		}
 		if(chunk->begin == chunk->end){
 			chunk = chunk->next;
-			delete m_first;
+			Chunk::destroy(m_first);
 			m_first = chunk;
 
 			if(chunk){
@@ -209,13 +442,13 @@ int StreamBuffer::get() NOEXCEPT {
 void StreamBuffer::put(unsigned char by){
 	std::size_t last_avail = 0;
 	if(m_last){
-		last_avail = sizeof(m_last->data) - m_last->end;
+		last_avail = m_last->get_tail_avail();
 	}
 	Chunk *last_chunk = NULLPTR;
 	if(last_avail != 0){
 		last_chunk = m_last;
 	} else {
-		AUTO(chunk, new Chunk);
+		AUTO(chunk, Chunk::create(CLASS_SMALL));
 		chunk->next = NULLPTR;
 		// chunk->prev = NULLPTR;
 		chunk->begin = 0;
@@ -235,7 +468,7 @@ void StreamBuffer::put(unsigned char by){
 	}
 
 	AUTO(chunk, last_chunk);
-	chunk->data[chunk->end] = by;
+	chunk->data()[chunk->end] = by;
 	++(chunk->end);
 	++m_size;
 }
@@ -249,11 +482,11 @@ int StreamBuffer::unput() NOEXCEPT {
 	do {
 		if(chunk->end != chunk->begin){
 			--(chunk->end);
-			ret = chunk->data[chunk->end];
+			ret = chunk->data()[chunk->end];
 		}
 		if(chunk->begin == chunk->end){
 			chunk = chunk->prev;
-			delete m_last;
+			Chunk::destroy(m_last);
 			m_last = chunk;
 
 			if(chunk){
@@ -269,17 +502,17 @@ int StreamBuffer::unput() NOEXCEPT {
 void StreamBuffer::unget(unsigned char by){
 	std::size_t first_avail = 0;
 	if(m_first){
-		first_avail = m_first->begin;
+		first_avail = m_first->get_head_avail();
 	}
 	Chunk *first_chunk = NULLPTR;
 	if(first_avail != 0){
 		first_chunk = m_first;
 	} else {
-		AUTO(chunk, new Chunk);
+		AUTO(chunk, Chunk::create(CLASS_SMALL));
 		// chunk->next = NULLPTR;
 		chunk->prev = NULLPTR;
-		chunk->begin = sizeof(chunk->data);
-		chunk->end = sizeof(chunk->data);
+		chunk->begin = chunk->capacity();
+		chunk->end = chunk->capacity();
 
 		if(m_first){
 			m_first->prev = chunk;
@@ -296,7 +529,7 @@ void StreamBuffer::unget(unsigned char by){
 
 	AUTO(chunk, first_chunk);
 	--(chunk->begin);
-	chunk->data[chunk->begin] = by;
+	chunk->data()[chunk->begin] = by;
 	++m_size;
 }
 
@@ -311,7 +544,7 @@ std::size_t StreamBuffer::peek(void *data, std::size_t bytes) const NOEXCEPT {
 	do {
 		const AUTO(write, static_cast<unsigned char *>(data) + bytes_copied);
 		const AUTO(bytes_to_copy_this_time, std::min<std::size_t>(bytes_to_copy - bytes_copied, chunk->end - chunk->begin));
-		std::memcpy(write, chunk->data + chunk->begin, bytes_to_copy_this_time);
+		std::memcpy(write, chunk->data() + chunk->begin, bytes_to_copy_this_time);
 		bytes_copied += bytes_to_copy_this_time;
 		chunk = chunk->next;
 	} while(bytes_copied < bytes_to_copy);
@@ -328,12 +561,12 @@ std::size_t StreamBuffer::get(void *data, std::size_t bytes) NOEXCEPT {
 	do {
 		const AUTO(write, static_cast<unsigned char *>(data) + bytes_copied);
 		const AUTO(bytes_to_copy_this_time, std::min<std::size_t>(bytes_to_copy - bytes_copied, chunk->end - chunk->begin));
-		std::memcpy(write, chunk->data + chunk->begin, bytes_to_copy_this_time);
+		std::memcpy(write, chunk->data() + chunk->begin, bytes_to_copy_this_time);
 		bytes_copied += bytes_to_copy_this_time;
 		chunk->begin += bytes_to_copy_this_time;
 		if(chunk->begin == chunk->end){
 			chunk = chunk->next;
-			delete m_first;
+			Chunk::destroy(m_first);
 			m_first = chunk;
 
 			if(chunk){
@@ -360,7 +593,7 @@ std::size_t StreamBuffer::discard(std::size_t bytes) NOEXCEPT {
 		chunk->begin += bytes_to_copy_this_time;
 		if(chunk->begin == chunk->end){
 			chunk = chunk->next;
-			delete m_first;
+			Chunk::destroy(m_first);
 			m_first = chunk;
 
 			if(chunk){
@@ -381,17 +614,17 @@ void StreamBuffer::put(const void *data, std::size_t bytes){
 
 	std::size_t last_avail = 0;
 	if(m_last){
-		last_avail = sizeof(m_last->data) - m_last->end;
+		last_avail = m_last->get_tail_avail();
 	}
 	Chunk *last_chunk = NULLPTR;
 	if(last_avail != 0){
 		last_chunk = m_last;
 	}
 	if(bytes_to_copy > last_avail){
-		const AUTO(new_chunks, (bytes_to_copy - last_avail - 1) / sizeof(last_chunk->data) + 1);
-		assert(new_chunks != 0);
+		// 根据剩余的字节数决定每个新块的大小。
+		std::size_t bytes_remaining = bytes_to_copy - last_avail;
 
-		AUTO(chunk, new Chunk);
+		AUTO(chunk, Chunk::create(get_class_for(bytes_remaining)));
 		chunk->next = NULLPTR;
 		chunk->prev = NULLPTR;
 		chunk->begin = 0;
@@ -399,8 +632,9 @@ void StreamBuffer::put(const void *data, std::size_t bytes){
 
 		AUTO(splice_first, chunk), splice_last = chunk;
 		try {
-			for(std::size_t i = 1; i < new_chunks; ++i){
-				chunk = new Chunk;
+			while(bytes_remaining > splice_last->capacity()){
+				bytes_remaining -= splice_last->capacity();
+				chunk = Chunk::create(get_class_for(bytes_remaining));
 				chunk->next = NULLPTR;
 				chunk->prev = splice_last;
 				chunk->begin = 0;
@@ -413,7 +647,7 @@ void StreamBuffer::put(const void *data, std::size_t bytes){
 			do {
 				chunk = splice_first;
 				splice_first = chunk->next;
-				delete chunk;
+				Chunk::destroy(chunk);
 			} while(splice_first);
 
 			throw;
@@ -435,8 +669,8 @@ void StreamBuffer::put(const void *data, std::size_t bytes){
 	AUTO(chunk, last_chunk);
 	do {
 		const AUTO(read, static_cast<const unsigned char *>(data) + bytes_copied);
-		const AUTO(bytes_to_copy_this_time, std::min<std::size_t>(bytes_to_copy - bytes_copied, sizeof(chunk->data) - chunk->end));
-		std::memcpy(chunk->data + chunk->end, read, bytes_to_copy_this_time);
+		const AUTO(bytes_to_copy_this_time, std::min<std::size_t>(bytes_to_copy - bytes_copied, chunk->capacity() - chunk->end));
+		std::memcpy(chunk->data() + chunk->end, read, bytes_to_copy_this_time);
 		chunk->end += bytes_to_copy_this_time;
 		bytes_copied += bytes_to_copy_this_time;
 		chunk = chunk->next;
@@ -450,6 +684,79 @@ void StreamBuffer::put(const std::string &str){
 	put(str.data(), str.size());
 }
 
+std::size_t StreamBuffer::reserve(::iovec *vecs, std::size_t max_vecs, std::size_t bytes){
+	if((max_vecs == 0) || (bytes == 0)){
+		return 0;
+	}
+
+	// 总是分配新的块，这样 commit() 可以通过末尾的空块找到预留的空间。
+	std::size_t count = 0;
+	std::size_t bytes_reserved = 0;
+	while((bytes_reserved < bytes) && (count < max_vecs)){
+		AUTO(chunk, Chunk::create(get_class_for(bytes - bytes_reserved)));
+		chunk->next = NULLPTR;
+		chunk->begin = 0;
+		chunk->end = 0;
+
+		if(m_last){
+			m_last->next = chunk;
+		} else {
+			m_first = chunk;
+		}
+		chunk->prev = m_last;
+		m_last = chunk;
+
+		vecs[count].iov_base = chunk->data();
+		vecs[count].iov_len = chunk->capacity();
+		bytes_reserved += vecs[count].iov_len;
+		++count;
+	}
+	return count;
+}
+void StreamBuffer::commit(std::size_t bytes) NOEXCEPT {
+	// 预留的块都位于末尾，并且都是空的。其他的块不可能为空。
+	AUTO(chunk, m_last);
+	while(chunk && chunk->prev && (chunk->prev->begin == chunk->prev->end)){
+		chunk = chunk->prev;
+	}
+	std::size_t bytes_committed = 0;
+	while(chunk && (bytes_committed < bytes)){
+		const AUTO(bytes_this_time, std::min<std::size_t>(bytes - bytes_committed, chunk->capacity() - chunk->end));
+		chunk->end += bytes_this_time;
+		bytes_committed += bytes_this_time;
+		chunk = chunk->next;
+	}
+	m_size += bytes_committed;
+
+	// 释放末尾未使用的块。
+	while(m_last && (m_last->begin == m_last->end)){
+		chunk = m_last;
+		m_last = chunk->prev;
+		Chunk::destroy(chunk);
+
+		if(m_last){
+			m_last->next = NULLPTR;
+		} else {
+			m_first = NULLPTR;
+		}
+	}
+}
+
+void StreamBuffer::unshare(){
+	for(AUTO(chunk, m_first); chunk; chunk = chunk->next){
+		if(!chunk->is_shared()){
+			continue;
+		}
+		const AUTO(bytes, chunk->end - chunk->begin);
+		const AUTO(storage, create_storage((bytes > SMALL_CHUNK_CAPACITY) ? CLASS_LARGE : CLASS_SMALL));
+		std::memcpy(storage->data(), chunk->data() + chunk->begin, bytes);
+		drop_storage_ref(chunk->storage);
+		chunk->storage = storage;
+		chunk->begin = 0;
+		chunk->end = bytes;
+	}
+}
+
 StreamBuffer StreamBuffer::cut_off(std::size_t bytes){
 	StreamBuffer ret;
 
@@ -472,13 +779,12 @@ StreamBuffer StreamBuffer::cut_off(std::size_t bytes){
 			if(bytes_remaining == bytes_avail){
 				cut_end = cut_end->next;
 			} else {
-				const AUTO(chunk, new Chunk);
+				// 两部分共享同一个存储块，不复制数据。
+				const AUTO(chunk, Chunk::create_shared(cut_end));
 				chunk->next = cut_end;
 				chunk->prev = cut_end->prev;
-				chunk->begin = 0;
-				chunk->end = bytes_remaining;
+				chunk->end = chunk->begin + bytes_remaining;
 
-				std::memcpy(chunk->data, cut_end->data + cut_end->begin, bytes_remaining);
 				cut_end->begin += bytes_remaining;
 
 				if(cut_end->prev){
@@ -10,6 +10,8 @@
 #include <iterator>
 #include <cstddef>
 
+struct iovec;
+
 namespace Poseidon {
 
 class StreamBuffer {
@@ -26,10 +28,8 @@ public:
 		Chunk *m_chunk;
 
 	public:
-		explicit ChunkEnumerator(StreamBuffer &rhs) NOEXCEPT
-			: m_chunk(rhs.m_first)
-		{
-		}
+		// 为了能修改数据，这里会复制所有被共享的存储块。
+		explicit ChunkEnumerator(StreamBuffer &rhs);
 
 	public:
 		unsigned char *begin() const NOEXCEPT;
@@ -157,11 +157,21 @@ public:
 		}
 	};
 
+public:
+	// 从系统分配的块的总字节数，包括全局池和线程缓存中空闲的块。
+	static std::size_t get_allocated_bytes() NOEXCEPT;
+	// 全局池中空闲的块的总字节数。
+	static std::size_t get_pooled_bytes() NOEXCEPT;
+
 private:
 	Chunk *m_first;
 	Chunk *m_last;
 	std::size_t m_size;
 
+private:
+	// 复制所有被共享的存储块，使当前对象独占所有数据。
+	void unshare();
+
 public:
 	CONSTEXPR StreamBuffer() NOEXCEPT
 		: m_first(NULLPTR), m_last(NULLPTR), m_size(0)
@@ -211,13 +221,19 @@ public:
 	ConstChunkEnumerator get_chunk_enumerator() const NOEXCEPT {
 		return ConstChunkEnumerator(*this);
 	}
-	ChunkEnumerator get_chunk_enumerator() NOEXCEPT {
+	ChunkEnumerator get_chunk_enumerator(){
 		return ChunkEnumerator(*this);
 	}
 	ConstChunkEnumerator get_const_chunk_enumerator() const NOEXCEPT {
 		return ConstChunkEnumerator(*this);
 	}
 
+	// 在末尾预留至少 bytes 字节的可写空间，填写 vecs 并返回使用的个数，最多 max_vecs 个。
+	// 预留的空间在 commit() 之前不计入 size()，并且在下一次修改操作之前必须调用 commit()。
+	std::size_t reserve(::iovec *vecs, std::size_t max_vecs, std::size_t bytes);
+	// 将 reserve() 预留空间的前 bytes 字节计入数据，释放其余部分。
+	void commit(std::size_t bytes) NOEXCEPT;
+
 	// 拆分成两部分，返回 [0, bytes) 部分，[bytes, -) 部分仍保存于当前对象中。
 	StreamBuffer cut_off(std::size_t bytes);
 	// cut_off() 的逆操作。该函数返回后 src 为空。
@@ -7,11 +7,11 @@
 #include "ip_port.hpp"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
-#include "singletons/timer_daemon.hpp"
 #include "log.hpp"
 #include "atomic.hpp"
 #include "endian.hpp"
@@ -25,6 +25,21 @@
 
 namespace Poseidon {
 
+namespace {
+	enum {
+		MAX_READ_VECS   = 256,
+		MAX_WRITE_VECS  = 256,
+	};
+
+	// 只复制开头的 size 个字节用于输出日志，不复制整个缓冲区。
+	std::string peek_prefix(const StreamBuffer &buffer, std::size_t size){
+		std::string str;
+		str.resize(size);
+		str.resize(buffer.peek(&str[0], size));
+		return str;
+	}
+}
+
 TcpSessionBase::DelayedShutdownGuard::DelayedShutdownGuard(boost::weak_ptr<TcpSessionBase> weak)
 	: m_weak(STD_MOVE(weak))
 {
@@ -47,40 +62,13 @@ TcpSessionBase::DelayedShutdownGuard::~DelayedShutdownGuard(){
 	}
 }
 
-void TcpSessionBase::shutdown_timer_proc(const boost::weak_ptr<TcpSessionBase> &weak, boost::uint64_t now){
-	const AUTO(session, weak.lock());
-	if(!session){
-		return;
-	}
-	if(now < session->m_shutdown_time){
-		return;
-	}
-
-	std::size_t send_buffer_size;
-	{
-		Mutex::UniqueLock lock;
-		send_buffer_size = session->get_send_buffer_size(lock);
-	}
-	if(send_buffer_size != 0){
-		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Send buffer is not empty. Retry later...");
-		return;
-	}
-
-	try {
-		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG, "Connection timed out: remote = ", session->get_remote_info());
-	} catch(...){
-		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG, "Connection timed out: remote is not connected");
-	}
-	atomic_store(session->m_timed_out, true, ATOMIC_RELEASE);
-	session->force_shutdown();
-}
-
 TcpSessionBase::TcpSessionBase(UniqueFile socket)
 	: m_socket(STD_MOVE(socket)), m_created_time(get_fast_mono_clock())
 	, m_peer_info()
 	, m_connected(false)
-	, m_shutdown_read(false), m_shutdown_write(false), m_really_shutdown_write(false), m_timed_out(false), m_throttled(false)
+	, m_shutdown_read(false), m_shutdown_write(false), m_really_shutdown_write(false), m_timed_out(false), m_throttled(false), m_read_paused(false)
 	, m_delayed_shutdown_guard_count(0)
+	, m_epoll_id(0)
 	, m_shutdown_time(0)
 {
 	const int flags = ::fcntl(m_socket.get(), F_GETFL);
@@ -114,13 +102,14 @@ void TcpSessionBase::init_ssl(Move<boost::scoped_ptr<SslFilterBase> > ssl_filter
 	swap(m_ssl_filter, ssl_filter);
 }
 
-void TcpSessionBase::set_epoll(boost::weak_ptr<Epoll> epoll) NOEXCEPT {
+void TcpSessionBase::set_epoll(boost::weak_ptr<Epoll> epoll, boost::uint64_t epoll_id) NOEXCEPT {
 	const Mutex::UniqueLock lock(m_buffer_mutex);
 	const AUTO(old_epoll, m_epoll.lock());
 	if(old_epoll){
 		old_epoll->notify_unlinked(this);
 	}
 	m_epoll = STD_MOVE(epoll);
+	atomic_store(m_epoll_id, epoll_id, ATOMIC_RELEASE);
 }
 void TcpSessionBase::notify_epoll_writeable() NOEXCEPT {
 	const AUTO(epoll, m_epoll.lock());
@@ -128,6 +117,40 @@ void TcpSessionBase::notify_epoll_writeable() NOEXCEPT {
 		epoll->notify_writeable(this);
 	}
 }
+void TcpSessionBase::notify_epoll_timeout() NOEXCEPT {
+	const AUTO(epoll, m_epoll.lock());
+	if(epoll){
+		epoll->notify_timeout(this);
+	}
+}
+void TcpSessionBase::notify_epoll_readable() NOEXCEPT {
+	const AUTO(epoll, m_epoll.lock());
+	if(epoll){
+		epoll->notify_readable(this);
+	}
+}
+bool TcpSessionBase::shutdown_timed_out() NOEXCEPT {
+	PROFILE_ME;
+
+	std::size_t send_buffer_size;
+	{
+		Mutex::UniqueLock lock;
+		send_buffer_size = get_send_buffer_size(lock);
+	}
+	if(send_buffer_size != 0){
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Send buffer is not empty. Retry later...");
+		return false;
+	}
+
+	try {
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG, "Connection timed out: remote = ", get_remote_info());
+	} catch(...){
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG, "Connection timed out: remote is not connected");
+	}
+	atomic_store(m_timed_out, true, ATOMIC_RELEASE);
+	force_shutdown();
+	return true;
+}
 
 void TcpSessionBase::fetch_peer_info() const {
 	const Mutex::UniqueLock lock(m_peer_info.mutex);
@@ -141,24 +164,47 @@ void TcpSessionBase::fetch_peer_info() const {
 	}
 }
 
-TcpSessionBase::SyncIoResult TcpSessionBase::sync_read_and_process(void *hint, unsigned long hint_size){
+TcpSessionBase::SyncIoResult TcpSessionBase::sync_read_and_process(unsigned long hint_size){
 	PROFILE_ME;
 
+	// 直接读入 StreamBuffer 的块中，避免再复制一次。
+	StreamBuffer data;
+	::iovec vecs[MAX_READ_VECS];
+	const AUTO(count, data.reserve(vecs, COUNT_OF(vecs), hint_size));
+
 	SyncIoResult ret;
 	if(m_ssl_filter){
-		ret.bytes_transferred = m_ssl_filter->read(hint, hint_size);
+		// SSL 不支持分散读取，逐块读取直到读不满一块为止。
+		ret.bytes_transferred = 0;
+		for(std::size_t i = 0; i < count; ++i){
+			const long bytes_read = m_ssl_filter->read(vecs[i].iov_base, vecs[i].iov_len);
+			if(bytes_read <= 0){
+				if(i == 0){
+					ret.bytes_transferred = bytes_read;
+				}
+				break;
+			}
+			ret.bytes_transferred += bytes_read;
+			if(static_cast<unsigned long>(bytes_read) < vecs[i].iov_len){
+				break;
+			}
+		}
 	} else {
-		ret.bytes_transferred = ::recv(m_socket.get(), hint, hint_size, MSG_NOSIGNAL);
+		ret.bytes_transferred = ::readv(m_socket.get(), vecs, static_cast<int>(count));
 	}
 	ret.err_code = errno;
 
 	if(ret.bytes_transferred > 0){
+		const AUTO(bytes, static_cast<std::size_t>(ret.bytes_transferred));
+		data.commit(bytes);
+
 		fetch_peer_info();
 
-		const AUTO(bytes, static_cast<std::size_t>(ret.bytes_transferred));
-		LOG_POSEIDON_TRACE("Read ", bytes, " byte(s) from ", get_remote_info(), ", hex = ", HexDumper(hint, bytes));
+		LOG_POSEIDON_TRACE("Read ", bytes, " byte(s) from ", get_remote_info(), ", hex = ", HexDumper(peek_prefix(data, bytes).data(), bytes));
 
-		on_read_avail(StreamBuffer(hint, bytes));
+		on_read_avail(STD_MOVE(data));
+	} else {
+		data.commit(0);
 	}
 
 	return ret;
@@ -166,33 +212,55 @@ TcpSessionBase::SyncIoResult TcpSessionBase::sync_read_and_process(void *hint, u
 TcpSessionBase::SyncIoResult TcpSessionBase::sync_write(void *hint, unsigned long hint_size){
 	PROFILE_ME;
 
-	std::size_t bytes_avail;
-	{
-		const Mutex::UniqueLock lock(m_buffer_mutex);
-		bytes_avail = m_send_buffer.peek(hint, hint_size);
-	}
-
 	SyncIoResult ret;
-	if(bytes_avail == 0){
-		ret.bytes_transferred = 0;
-	} else {
-		if(m_ssl_filter){
-			ret.bytes_transferred = m_ssl_filter->write(hint, bytes_avail);
+	std::size_t bytes_avail;
+	if(m_ssl_filter){
+		{
+			const Mutex::UniqueLock lock(m_buffer_mutex);
+			bytes_avail = m_send_buffer.peek(hint, hint_size);
+		}
+		if(bytes_avail == 0){
+			ret.bytes_transferred = 0;
 		} else {
-			ret.bytes_transferred = ::send(m_socket.get(), hint, bytes_avail, MSG_NOSIGNAL);
+			ret.bytes_transferred = m_ssl_filter->write(hint, bytes_avail);
+			ret.err_code = errno;
 		}
-		ret.err_code = errno;
-
-		if(ret.bytes_transferred > 0){
-			fetch_peer_info();
-
-			const AUTO(bytes, static_cast<std::size_t>(ret.bytes_transferred));
-			LOG_POSEIDON_TRACE("Wrote ", bytes, " byte(s) to ", get_remote_info(), ", hex = ", HexDumper(hint, bytes));
-
+	} else {
+		// 只有 epoll 线程会从发送缓冲区中移除数据，其他线程只会在末尾追加，
+		// 因此解锁之后这些块中 [begin, end) 的数据仍然有效。
+		::iovec vecs[MAX_WRITE_VECS];
+		std::size_t count = 0;
+		{
 			const Mutex::UniqueLock lock(m_buffer_mutex);
-			m_send_buffer.discard(bytes);
 			bytes_avail = m_send_buffer.size();
+			for(AUTO(ce, m_send_buffer.get_const_chunk_enumerator()); ce && (count < COUNT_OF(vecs)); ++ce){
+				if(ce.size() == 0){
+					continue;
+				}
+				vecs[count].iov_base = const_cast<unsigned char *>(ce.data());
+				vecs[count].iov_len = ce.size();
+				++count;
+			}
 		}
+		if(count == 0){
+			ret.bytes_transferred = 0;
+		} else {
+			::msghdr msg = { };
+			msg.msg_iov = vecs;
+			msg.msg_iovlen = count;
+			ret.bytes_transferred = ::sendmsg(m_socket.get(), &msg, MSG_NOSIGNAL);
+			ret.err_code = errno;
+		}
+	}
+
+	if(ret.bytes_transferred > 0){
+		fetch_peer_info();
+
+		const AUTO(bytes, static_cast<std::size_t>(ret.bytes_transferred));
+		const Mutex::UniqueLock lock(m_buffer_mutex);
+		LOG_POSEIDON_TRACE("Wrote ", bytes, " byte(s) to ", get_remote_info(), ", hex = ", HexDumper(peek_prefix(m_send_buffer, bytes).data(), bytes));
+		m_send_buffer.discard(bytes);
+		bytes_avail = m_send_buffer.size();
 	}
 
 	if((bytes_avail == 0) && atomic_load(m_really_shutdown_write, ATOMIC_CONSUME)){
@@ -289,15 +357,11 @@ const IpPort &TcpSessionBase::get_local_info() const {
 void TcpSessionBase::set_timeout(boost::uint64_t timeout){
 	PROFILE_ME;
 
-	const Mutex::UniqueLock lock(m_timer_mutex);
-	if(timeout == 0){
-		m_shutdown_timer.reset();
-	} else {
-		if(!m_shutdown_timer){
-			m_shutdown_timer = TimerDaemon::register_timer(timeout, timeout,
-				boost::bind(&shutdown_timer_proc, virtual_weak_from_this<TcpSessionBase>(), _2), true);
-		}
-		m_shutdown_time = get_fast_mono_clock() + timeout;
+	const boost::uint64_t shutdown_time = (timeout == 0) ? 0 : (get_fast_mono_clock() + timeout);
+	const AUTO(old_shutdown_time, atomic_exchange(m_shutdown_time, shutdown_time, ATOMIC_ACQ_REL));
+	// 推迟超时不需要通知 epoll，它检查到期的连接时会重新读取这个值。
+	if((shutdown_time != 0) && ((old_shutdown_time == 0) || (shutdown_time < old_shutdown_time))){
+		notify_epoll_timeout();
 	}
 }
 
@@ -316,7 +380,20 @@ bool TcpSessionBase::is_throttled() const {
 	return atomic_load(m_throttled, ATOMIC_CONSUME);
 }
 void TcpSessionBase::set_throttled(bool throttled){
-	atomic_store(m_throttled, throttled, ATOMIC_RELEASE);
+	const AUTO(old_throttled, atomic_exchange(m_throttled, throttled, ATOMIC_SEQ_CST));
+	if(old_throttled && !throttled && !atomic_load(m_read_paused, ATOMIC_SEQ_CST)){
+		notify_epoll_readable();
+	}
+}
+
+bool TcpSessionBase::is_read_paused() const {
+	return atomic_load(m_read_paused, ATOMIC_CONSUME);
+}
+void TcpSessionBase::set_read_paused(bool paused){
+	const AUTO(old_paused, atomic_exchange(m_read_paused, paused, ATOMIC_SEQ_CST));
+	if(old_paused && !paused && !atomic_load(m_throttled, ATOMIC_SEQ_CST)){
+		notify_epoll_readable();
+	}
 }
 
 }
@@ -23,7 +23,6 @@ namespace Poseidon {
 
 class Epoll;
 class SslFilterBase;
-class TimerItem;
 
 class TcpServerBase;
 class TcpClientBase;
@@ -51,9 +50,6 @@ public:
 		~DelayedShutdownGuard();
 	};
 
-private:
-	static void shutdown_timer_proc(const boost::weak_ptr<TcpSessionBase> &weak, boost::uint64_t now);
-
 private:
 	const UniqueFile m_socket;
 	const boost::uint64_t m_created_time;
@@ -72,15 +68,16 @@ private:
 	volatile bool m_really_shutdown_write;
 	volatile bool m_timed_out;
 	volatile bool m_throttled;
+	volatile bool m_read_paused;
 	volatile std::size_t m_delayed_shutdown_guard_count;
 
 	mutable Mutex m_buffer_mutex;
 	StreamBuffer m_send_buffer;
 	boost::weak_ptr<Epoll> m_epoll;
+	volatile boost::uint64_t m_epoll_id;
 
+	// 零表示没有超时。由 epoll 线程检查。
 	volatile boost::uint64_t m_shutdown_time;
-	mutable Mutex m_timer_mutex;
-	boost::shared_ptr<TimerItem> m_shutdown_timer;
 
 protected:
 	explicit TcpSessionBase(UniqueFile socket);
@@ -91,20 +88,29 @@ private:
 
 	void init_ssl(Move<boost::scoped_ptr<SslFilterBase> > ssl_filter);
 
-	void set_epoll(boost::weak_ptr<Epoll> epoll) NOEXCEPT;
+	void set_epoll(boost::weak_ptr<Epoll> epoll, boost::uint64_t epoll_id) NOEXCEPT;
 	void notify_epoll_writeable() NOEXCEPT;
+	void notify_epoll_timeout() NOEXCEPT;
+	void notify_epoll_readable() NOEXCEPT;
+	// 超时之后由 epoll 线程调用。如果发送缓冲区不为空，返回 false，稍后再试。
+	bool shutdown_timed_out() NOEXCEPT;
 
 	// 同步，线程安全。
 	void fetch_peer_info() const;
 	// 和 Windows 的 IsDialogMessage() 类似，这个函数读取并在内部调用 on_read_avail() 处理数据。
-	// 这里的出参返回读取的数据，一次性读取的字节数不大于 hint_size。如果开启了 SSL，返回明文。
-	SyncIoResult sync_read_and_process(void *hint, unsigned long hint_size);
-	// 这里的出参返回写入的数据，一次性写入的字节数不大于 hint_size。如果开启了 SSL，返回明文。
+	// 数据被直接读入 StreamBuffer 中，一次性读取的字节数不大于 hint_size。如果开启了 SSL，读取的是明文。
+	SyncIoResult sync_read_and_process(unsigned long hint_size);
+	// 直接从发送缓冲区的块中分散写入。如果开启了 SSL，则经过 hint 复制，一次性写入的字节数不大于 hint_size。
 	SyncIoResult sync_write(void *hint, unsigned long hint_size);
 	// 出参用于确保 epoll 和写入内部缓冲的顺序。
 	std::size_t get_send_buffer_size(Mutex::UniqueLock &lock) const;
 
 protected:
+	// 供派生类内部的流量控制使用（例如 HTTP 流水线），和 set_throttled() 相互独立，互不覆盖。
+	// 二者任意一个为 true 时 epoll 线程都不读取这个连接。
+	bool is_read_paused() const;
+	void set_read_paused(bool paused);
+
 	void on_connect() OVERRIDE;
 	void on_read_hup() NOEXCEPT OVERRIDE;
 	void on_close(int err_code) NOEXCEPT OVERRIDE; // 参数就是 errno。
@@ -141,6 +147,8 @@ public:
 	void set_no_delay(bool enabled);
 
 	bool is_throttled() const;
+	// 节流期间 epoll 线程不读取这个连接。解除节流之后会立即唤醒 epoll 线程，
+	// 并在下次读取之前以空数据调用一次 on_read_avail()，派生类可以借此处理之前暂缓的数据。
 	void set_throttled(bool throttled);
 };
 
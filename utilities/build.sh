@@ -1,4 +1,9 @@
 #!/bin/bash
 
 mkdir -p bin
-find . -name '*.cpp' | sed 's,\.cpp,,' | xargs -i g++ {}.cpp -o bin/{} -O3
+find . -name '*.cpp' ! -name 'profiler_bench.cpp' | sed 's,\.cpp,,' | xargs -i g++ {}.cpp -o bin/{} -O3
+
+# profiler_bench 需要先编译 poseidon。
+if [ -e ../lib/.libs/libposeidon-main.so ]; then
+	g++ profiler_bench.cpp -o bin/profiler_bench -O3 -pthread -L../lib/.libs -Wl,-rpath,"$(pwd)/../lib/.libs" -lposeidon-main
+fi
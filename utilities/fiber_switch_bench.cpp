@@ -0,0 +1,163 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2016, LH_Mouse. All wrongs reserved.
+
+// 这个文件被置于公有领域（public domain）。
+
+// 比较 swapcontext() 和 JobDispatcher 在 x86_64 上使用的栈切换函数。
+// 两个上下文来回切换，输出每次切换的平均耗时。用法：fiber_switch_bench [往返次数]
+
+#include <ucontext.h>
+#include <time.h>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+#ifdef __x86_64__
+// 与 src/singletons/job_dispatcher.cpp 中的实现相同。
+extern "C" void bench_switch_stack(void **save_sp, void *load_sp);
+extern "C" void bench_stack_entry();
+
+__asm__(
+	".pushsection .text \n"
+	".globl bench_switch_stack \n"
+	".type bench_switch_stack, @function \n"
+	".p2align 4 \n"
+	"bench_switch_stack: \n"
+	"	pushq %rbp \n"
+	"	pushq %rbx \n"
+	"	pushq %r12 \n"
+	"	pushq %r13 \n"
+	"	pushq %r14 \n"
+	"	pushq %r15 \n"
+	"	subq $8, %rsp \n"
+	"	stmxcsr (%rsp) \n"
+	"	fnstcw 4(%rsp) \n"
+	"	movq %rsp, (%rdi) \n"
+	"	movq %rsi, %rsp \n"
+	"	ldmxcsr (%rsp) \n"
+	"	fldcw 4(%rsp) \n"
+	"	addq $8, %rsp \n"
+	"	popq %r15 \n"
+	"	popq %r14 \n"
+	"	popq %r13 \n"
+	"	popq %r12 \n"
+	"	popq %rbx \n"
+	"	popq %rbp \n"
+	"	ret \n"
+	".size bench_switch_stack, .-bench_switch_stack \n"
+	".globl bench_stack_entry \n"
+	".type bench_stack_entry, @function \n"
+	".p2align 4 \n"
+	"bench_stack_entry: \n"
+	"	movq %r12, %rdi \n"
+	"	callq *%r13 \n"
+	"	ud2 \n"
+	".size bench_stack_entry, .-bench_stack_entry \n"
+	".popsection \n"
+);
+#endif
+
+namespace {
+
+const std::size_t STACK_SIZE = 64 * 1024;
+
+unsigned long g_rounds = 10000000;
+
+double get_ns(){
+	::timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void print_result(const char *name, double begin, double end){
+	std::cout <<std::setw(14) <<std::left <<name
+	          <<std::fixed <<std::setprecision(1) <<(end - begin) / (g_rounds * 2.0) <<" ns/switch" <<std::endl;
+}
+
+::ucontext_t g_outer;
+::ucontext_t g_inner;
+
+void ucontext_proc(){
+	for(;;){
+		::swapcontext(&g_inner, &g_outer);
+	}
+}
+
+void bench_ucontext(){
+	char *const stack = static_cast<char *>(std::malloc(STACK_SIZE));
+	::getcontext(&g_inner);
+	g_inner.uc_stack.ss_sp = stack;
+	g_inner.uc_stack.ss_size = STACK_SIZE;
+	g_inner.uc_link = 0;
+	::makecontext(&g_inner, &ucontext_proc, 0);
+
+	const double begin = get_ns();
+	for(unsigned long i = 0; i < g_rounds; ++i){
+		::swapcontext(&g_outer, &g_inner);
+	}
+	const double end = get_ns();
+	print_result("ucontext", begin, end);
+	std::free(stack);
+}
+
+#ifdef __x86_64__
+void *g_outer_sp;
+void *g_inner_sp;
+
+void asm_proc(void *){
+	for(;;){
+		::bench_switch_stack(&g_inner_sp, g_outer_sp);
+	}
+}
+
+void bench_asm(){
+	char *const stack = static_cast<char *>(std::malloc(STACK_SIZE));
+
+	// 与 JobDispatcher 中 prepare_fiber_context() 构造的初始栈帧相同。
+	unsigned mxcsr;
+	unsigned short fpucw;
+	__asm__ __volatile__(
+		"stmxcsr %0 \n"
+		"fnstcw %1 \n"
+		: "=m"(mxcsr), "=m"(fpucw)
+	);
+	void **const frame = reinterpret_cast<void **>(reinterpret_cast<unsigned long>(stack + STACK_SIZE) & ~15ul) - 10;
+	for(unsigned i = 0; i < 10; ++i){
+		frame[i] = 0;
+	}
+	*reinterpret_cast<unsigned *>(frame) = mxcsr;
+	*reinterpret_cast<unsigned short *>(reinterpret_cast<char *>(frame) + 4) = fpucw;
+	frame[3] = reinterpret_cast<void *>(&asm_proc);
+	frame[7] = reinterpret_cast<void *>(&::bench_stack_entry);
+	g_inner_sp = frame;
+
+	const double begin = get_ns();
+	for(unsigned long i = 0; i < g_rounds; ++i){
+		::bench_switch_stack(&g_outer_sp, g_inner_sp);
+	}
+	const double end = get_ns();
+	print_result("switch_stack", begin, end);
+	std::free(stack);
+}
+#endif
+
+}
+
+int main(int argc, char **argv){
+	if(argc > 1){
+		g_rounds = std::strtoul(argv[1], 0, 0);
+		if(g_rounds == 0){
+			std::cerr <<"Invalid round count: " <<argv[1] <<std::endl;
+			return 1;
+		}
+	}
+	std::cout <<"Rounds: " <<g_rounds <<std::endl;
+
+	bench_ucontext();
+#ifdef __x86_64__
+	bench_asm();
+#else
+	std::cout <<"switch_stack is only available on x86_64." <<std::endl;
+#endif
+	return 0;
+}
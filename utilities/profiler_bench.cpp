@@ -0,0 +1,98 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2016, LH_Mouse. All wrongs reserved.
+
+// 这个文件被置于公有领域（public domain）。
+
+// 分别使用 CLOCK_MONOTONIC 和 TSC 计时，测量一对嵌套的 PROFILE_ME 的开销。用法：profiler_bench [循环次数]
+// 这个程序需要链接 libposeidon-main，参考 build.sh。
+
+#include "../src/precompiled.hpp"
+#include "../src/profiler.hpp"
+#include "../src/singletons/profile_depository.hpp"
+#include "../src/singletons/main_config.hpp"
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <cstdlib>
+
+namespace {
+
+unsigned long g_rounds = 10000000;
+
+double get_ns(){
+	::timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+__attribute__((__noinline__)) void inner(){
+	PROFILE_ME;
+	__asm__ __volatile__("" ::: "memory");
+}
+__attribute__((__noinline__)) void outer(){
+	PROFILE_ME;
+	inner();
+}
+
+void start_profiler(const char *run_path, bool use_tsc){
+	{
+		std::ofstream conf((std::string(run_path) + "/main.conf").c_str());
+		conf <<"enable_profiler = 1" <<std::endl
+		     <<"profiler_use_tsc = " <<use_tsc <<std::endl;
+	}
+	Poseidon::MainConfig::set_run_path(run_path);
+	Poseidon::MainConfig::reload();
+	Poseidon::ProfileDepository::start();
+}
+
+void bench(const char *name){
+	for(unsigned long i = 0; i < g_rounds / 10; ++i){
+		outer();
+	}
+	const double begin = get_ns();
+	for(unsigned long i = 0; i < g_rounds; ++i){
+		outer();
+	}
+	const double end = get_ns();
+	std::cout <<std::setw(18) <<std::left <<name
+	          <<std::fixed <<std::setprecision(1) <<(end - begin) / g_rounds <<" ns/pair" <<std::endl;
+}
+
+}
+
+int main(int argc, char **argv){
+	if(argc > 1){
+		g_rounds = std::strtoul(argv[1], 0, 0);
+		if(g_rounds == 0){
+			std::cerr <<"Invalid round count: " <<argv[1] <<std::endl;
+			return 1;
+		}
+	}
+
+	char run_path[] = "/tmp/profiler_bench.XXXXXX";
+	if(!::mkdtemp(run_path)){
+		std::cerr <<"Failed to create temporary directory." <<std::endl;
+		return 1;
+	}
+	std::cout <<"Rounds: " <<g_rounds <<std::endl;
+
+	// ProfileDepository::stop() 不会切换回 CLOCK_MONOTONIC，所以先测量 CLOCK_MONOTONIC。
+	start_profiler(run_path, false);
+	bench("CLOCK_MONOTONIC");
+	start_profiler(run_path, true);
+	bool uses_tsc;
+	Poseidon::ProfileDepository::get_ticks(uses_tsc);
+	if(uses_tsc){
+		bench("TSC");
+	} else {
+		std::cout <<"TSC is not available on this machine." <<std::endl;
+	}
+	Poseidon::ProfileDepository::stop();
+
+	::unlink((std::string(run_path) + "/main.conf").c_str());
+	::rmdir(run_path);
+	return 0;
+}